@@ -1,30 +1,261 @@
+#define _DEFAULT_SOURCE  // POSIX and BSD extensions like MAP_ANONYMOUS are hidden under -std=c17
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <math.h>
+#include <signal.h>
+#include <stdatomic.h>
 
+// The embeddable core from make lib leaves the window, audio, input and threads to the host. Without SDL
+// log messages go to stderr, and tracing isn't available since its writer thread comes from SDL
+#ifdef CHIP8_LIBRARY
+#include "chip8.h"
+#define SDL_Log(...) fprintf(stderr, __VA_ARGS__)
+#define SDL_Delay(ms) (void) (ms)  // only reached waiting on a trace writer, which library machines never have
+typedef struct SDL_Thread SDL_Thread;
+#else
 #include <SDL.h>
+#endif
+
+// the native code backend needs an x86-64 host and mmap for executable memory
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_SUPPORTED
+#include <sys/mman.h>
+#include <stddef.h>
+#endif
+
+// POSIX hosts map ROM files and libraries instead of reading them, and can publish profiles as shared memory.
+// They also sleep between frames with nanosecond resolution
+#ifdef __unix__
+#define MMAP_SUPPORTED
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+// Linux hosts can serve sessions over TCP from an epoll loop
+#ifdef __linux__
+#define SERVER_SUPPORTED
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#endif
+
+#define DISPLAY_WIDTH 128  // SUPER-CHIP hires resolution, the largest the display gets
+#define DISPLAY_HEIGHT 64
+#define DISPLAY_WORDS (DISPLAY_WIDTH / 64) // each row is packed into 64 bit words, bit 63 of the first is the leftmost pixel
+#define DISPLAY_PLANES 2   // XO-CHIP bitplanes, together they pick one of 4 colors per pixel
+#define LORES_WIDTH 64     // original chip8 resolution, lores mode only uses the first word of the first 32 rows
+#define LORES_HEIGHT 32
+
+#define RAM_SIZE 0x10000   // XO-CHIP address space, the original 4k machine is the bottom of it
+#define RAM_MASK (RAM_SIZE - 1)
+#define RAM_SLACK 64       // allocated past the end, so sprite reads from I never have to wrap
+#define BIG_FONT 0x50      // address of the SUPER-CHIP font, right after the small one
+
+#define FRAME_RATE 60          // display and timer rate of the chip8
+#define MAX_CATCHUP_FRAMES 5   // when further behind than this the missed frames are dropped instead of emulated
+#define INPUT_SLICES 8         // an on time frame runs in this many parts, with the keypad sampled before each
+
+#define WAVETABLE_BITS 10      // the tone is looked up from a 1024 entry table
+#define WAVETABLE_SIZE (1 << WAVETABLE_BITS)
+
+// Tone generator state; everything but gate is written once before the device starts and then owned by the callback
+typedef struct {
+  int16_t wavetable[WAVETABLE_SIZE]; // one period of a band-limited square wave at the configured volume
+  uint32_t phase;                    // 32 bit phase accumulator, the top WAVETABLE_BITS index the table
+  uint32_t phase_step;               // phase advance per output sample
+  uint32_t samples_per_tick;         // output samples per 60hz timer tick
+  atomic_uint gate;                  // samples left to play, published by the main thread every frame
+} audio_t;
+
+// Keypad state kept by the event watch as events are pumped, and sampled by the emulation thread
+typedef struct {
+  atomic_uint_least16_t keypad;   // bit n set while key n is down
+  atomic_uint_least16_t taps;     // keys pressed since the last sample, so a press released before it isn't lost
+  atomic_uint_least64_t pressed;  // performance counter at the oldest press not yet sampled, 0 if none
+} input_t;
 
+// Requests from the window thread, applied by the emulation thread between frames
+typedef enum {
+  REQUEST_SAVE_STATE = 1 << 0,
+  REQUEST_LOAD_STATE = 1 << 1,
+  REQUEST_PROFILE_DUMP = 1 << 2,  // the counters are the emulation thread's, so only it can report them whole
+} request_t;
+
+typedef struct {
+  atomic_bool quit;
+  atomic_bool paused;
+  atomic_bool turbo;
+  atomic_bool rewinding;
+  atomic_int rom_switch;      // library step to take, -1 or 1, 0 once taken
+  atomic_uint requests;       // request_t bits not handled yet
+} controls_t;
+
+// Packed display planes, a pixel's color is picked by its bit in each plane
+typedef struct {
+  uint64_t rows[DISPLAY_PLANES][DISPLAY_HEIGHT][DISPLAY_WORDS];
+  bool hires;                 // 128x64 SUPER-CHIP mode, otherwise the top left 64x32 is shown
+} display_t;
+
+// One display handed from the emulation thread to the window thread
+typedef struct {
+  display_t display;
+  uint64_t press;             // oldest key press this display is the first response to, 0 if none
+} frame_t;
+
+// Lock free triple buffer. The emulation thread fills back, the window thread shows front, and latest is
+// swapped with either of them, so the emulator always has a buffer to write and never waits on a present
+#define FRAME_FRESH 4u        // set in latest until the window thread takes that frame
+
+typedef struct {
+  frame_t frames[3];
+  uint32_t back;              // only used by the emulation thread
+  uint32_t front;             // only used by the window thread
+  atomic_uint latest;         // index of the newest complete frame, with FRAME_FRESH
+} framebuffer_t;
+
+#ifndef CHIP8_LIBRARY
 // SDL container
 typedef struct {
   SDL_Window *window;
   SDL_Renderer *renderer;
+  SDL_Texture *texture;   // streaming hires sized framebuffer for the texture renderer
+  SDL_Color colors[1 << DISPLAY_PLANES];  // config colors split into components, indexed by a pixel's plane bits
+  uint32_t palette[1 << DISPLAY_PLANES];  // the same colors as RGBA8888 texels
   SDL_AudioSpec want, have;
   SDL_AudioDeviceID device;
+  audio_t audio;          // userdata for the audio callback
+  input_t input;          // userdata for the event watch
 } sdl_t;
+#endif
+
+// Screen rendering backends
+typedef enum {
+  RENDERER_TEXTURE, // upload display into a streaming texture and let the GPU scale it
+  RENDERER_RECT     // one filled rectangle per chip8 pixel
+} renderer_t;
+
+#ifndef CHIP8_LIBRARY
+// --renderer names, indexed by renderer_t
+static const char *const renderer_names[] = {"texture", "rect"};
+#endif
+
+// Pixel formats of frames exported to shared memory
+typedef enum {
+  EXPORT_PACKED,  // the display planes as the machine keeps them, 64 pixels per word
+  EXPORT_RGBA     // RGBA8888 pixels in the configured colors
+} export_format_t;
+
+#ifndef CHIP8_LIBRARY
+// --export-format names, indexed by export_format_t
+static const char *const export_format_names[] = {"packed", "rgba"};
+#endif
+
+// Instruction execution engines
+typedef enum {
+  ENGINE_SWITCH, // fetch, decode and switch on every instruction
+  ENGINE_CACHED, // reuse pre-decoded instructions from the decode cache
+  ENGINE_BLOCK,  // run cached straight-line blocks of pre-bound handlers
+  ENGINE_JIT     // compile blocks to native code, falling back to handlers for complex opcodes
+} engine_t;
+
+#ifndef CHIP8_LIBRARY
+// --engine names, indexed by engine_t
+static const char *const engine_names[] = {"switch", "cached", "block", "jit"};
+#endif
+
+// Behaviours that differ between CHIP-8 implementations. Without any of them the emulator behaves as it
+// always has: shifts work on VX in place, FX55/FX65 leave I alone, sprites clip and BNNN adds V0
+typedef enum {
+  QUIRK_VF_RESET  = 1 << 0,  // 8XY1/8XY2/8XY3 clear VF
+  QUIRK_SHIFT_VY  = 1 << 1,  // 8XY6/8XYE shift VY into VX
+  QUIRK_MEMORY_I  = 1 << 2,  // FX55/FX65 advance I past the last register, I += X + 1
+  QUIRK_MEMORY_IX = 1 << 3,  // FX55/FX65 advance I to the last register, I += X
+  QUIRK_JUMP_VX   = 1 << 4,  // BNNN is BXNN, a jump to XNN + VX
+  QUIRK_WRAP      = 1 << 5,  // DXYN wraps sprites around the display edges
+  QUIRK_LONG_SKIP = 1 << 6,  // skips step over all of a 4 byte F000 NNNN
+} quirk_t;
+
+// Quirk profiles as enum value, name, suffix of their handlers and quirk bits. Each profile gets its own
+// handlers and interpreter loop with the bits folded in at compile time, the default profile's have no suffix
+#define QUIRK_PROFILES(X) \
+  X(QUIRKS_DEFAULT, "default", ,        0) \
+  X(QUIRKS_VIP,     "vip",     _vip,    QUIRK_VF_RESET | QUIRK_SHIFT_VY | QUIRK_MEMORY_I) \
+  X(QUIRKS_CHIP48,  "chip48",  _chip48, QUIRK_MEMORY_IX | QUIRK_JUMP_VX) \
+  X(QUIRKS_SCHIP,   "schip",   _schip,  QUIRK_JUMP_VX) \
+  X(QUIRKS_XOCHIP,  "xochip",  _xochip, QUIRK_SHIFT_VY | QUIRK_MEMORY_I | QUIRK_WRAP | QUIRK_LONG_SKIP)
+
+typedef enum {
+#define QUIRK_PROFILE_ENUM(id, name, suffix, bits) id,
+  QUIRK_PROFILES(QUIRK_PROFILE_ENUM)
+#undef QUIRK_PROFILE_ENUM
+  QUIRK_PROFILE_COUNT
+} quirk_profile_t;
+
+#ifndef CHIP8_LIBRARY
+// --quirks names, indexed by quirk_profile_t. Library entries store the index
+static const char *const quirk_profile_names[] = {
+#define QUIRK_PROFILE_NAME(id, name, suffix, bits) name,
+  QUIRK_PROFILES(QUIRK_PROFILE_NAME)
+#undef QUIRK_PROFILE_NAME
+};
+#endif
 
 // Emulator config container
-typedef struct {
+typedef struct config {
   uint32_t window_width;
   uint32_t window_height;
   uint32_t foreground_color;  // RGBA8888
   uint32_t background_color;  // RGBA8888
+  uint32_t plane2_color;      // RGBA8888, pixels only set in the second XO-CHIP plane
+  uint32_t blend_color;       // RGBA8888, pixels set in both planes
   uint32_t scale_factor;      // amount by which to scale up chip8 pixels
   uint32_t clock_speed;       // number of instructions to run per second
   uint32_t square_wave_freq;  // for audio playback
   uint32_t audio_sample_rate; // for audio playback
+  uint32_t audio_samples;     // audio device buffer in samples, smaller trades more callbacks for less latency
   int16_t volume;             // loudness of audio
+  renderer_t renderer;        // screen rendering backend
+  bool vsync;                 // let presents wait for vertical blank
+  uint32_t turbo_factor;      // emulated frames per real frame while fast forwarding
+  uint32_t rewind_seconds;    // length of the rewind history, 0 disables rewinding
+  const char *library_path;   // ROM library archive to run from, the ROM arguments name entries in it
+  const char *pack_path;      // ROM library archive to build from the ROM arguments instead of running
+  const char *record_path;    // input log written while playing, NULL for none
+  const char *trace_path;     // binary instruction trace written in the background, NULL for none
+  const char *decode_trace_path; // trace file to print as text instead of running anything
+  bool profile;               // count executed opcodes, PCs and frame phases, dumped on exit and F9
+  const char *profile_shm;    // shared memory object name the profile is published under, NULL for none
+  const char *export_shm;     // shared memory object name frames are exported under, NULL for none
+  export_format_t export_format;
+  const char *replay_path;    // input log to play back headless, NULL for none
+  engine_t engine;            // instruction execution engine
+  int quirk_profile;          // quirk_profile_t to run with, -1 leaves it to the library entry or the default
+  bool headless;              // run without window, audio or frame delay
+  bool precise;               // spin out the end of every frame to hit its deadline exactly, keeping a core busy
+  uint64_t max_cycles;        // stop after this many instructions, 0 for no limit
+  uint64_t max_frames;        // stop after this many 60hz frames, 0 for no limit
+  const char **roms;          // ROM files to run, in command line order
+  uint32_t rom_count;
+  uint32_t repeat;            // headless instances to run per ROM
+  uint32_t jobs;              // headless worker threads, 0 for one per CPU
+  uint32_t seed;              // CXNN random seed, instance i of a multi-instance run uses seed + i
+  bool seed_given;            // seed was set by an option, so even 0 is used as is instead of a random one
+  bool batch;                 // run headless instances in SIMD lockstep batches
+  bool bench;                 // run the benchmark suite on every engine, the ROMs are its corpus
+  bool precompile;            // translate the ROM's blocks for the engine before running it
+  const char *precompile_cache; // directory ROM analyses are kept in by memory hash, NULL for none
+  uint32_t serve_port;        // TCP port to serve sessions of the ROM on, 0 to run it locally instead
+  uint32_t max_sessions;      // clients served at once, more are turned away
+  const char *config_path;    // option file read before the command line, NULL for none
 } config_t;
 
 // Program state
@@ -42,58 +273,596 @@ typedef struct {
   uint8_t Y;        // 4 bit register identifier - __Y_
 } instruction_t;
 
-// Chip8 machine object
+struct chip8;
+
+// Executes one already decoded instruction
+typedef void (*op_handler_t)(struct chip8 *chip8, const instruction_t *inst);
+
+// Decode cache entry, a NULL handler means the address has not been decoded yet
+typedef struct {
+  op_handler_t handler;
+  instruction_t inst;
+} decoded_t;
+
+#define MAX_BLOCK_LENGTH 32 // longest run of instructions translated into one block
+
+// Native code compiled from a block by the JIT engine
+typedef void (*native_block_t)(struct chip8 *chip8);
+
+// Straight-line run of instructions ending at a jump, call, return, skip or ram store
+typedef struct {
+  uint8_t length;                  // number of instructions, 0 once invalidated
+  native_block_t native;           // compiled code for the JIT engine, NULL until compiled
+  decoded_t ops[MAX_BLOCK_LENGTH];
+} block_t;
+
+// Executable memory the JIT engine bump allocates compiled blocks from. It is writable or executable,
+// never both: compiling makes it writable and running a block flips it back, so a run of compiles pays once
+typedef struct {
+  uint8_t *code;
+  size_t size;
+  size_t used;
+  bool executable;
+} jit_t;
+
+// Translated blocks for the block engine
+typedef struct {
+  block_t *blocks[RAM_SIZE]; // indexed by start address, allocated on first translation
+  bool code[RAM_SIZE];       // ram bytes that some translated block was read from
+} block_cache_t;
+
+// Phases of a windowed frame timed by the profiler
+typedef enum {
+  PHASE_EMULATE, PHASE_RENDER, PHASE_PRESENT, PHASE_SLEEP, PHASE_COUNT
+} phase_t;
+
+#define PROFILE_MAGIC 0x464F5250u  // "PROF", lets a viewer check it mapped the right object
+#define PROFILE_VERSION 3
+#define FRAME_TIME_BUCKETS 34      // 1ms wide frame time buckets, the last one collects everything slower
+
+// Execution profile. It holds no pointers so it can live in shared memory and be read while running.
+// Input latency and the render and present phases are written by the window thread, the rest by the emulator
 typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t instructions;          // executed one by one, not counting idle skips
+  uint64_t idle_cycles;           // consumed by skipping idle loops
+  uint64_t frames;
+  uint64_t opcode_hits[65536];    // by raw opcode
+  uint64_t pc_hits[RAM_SIZE];
+  uint64_t phase_ns[PHASE_COUNT];
+  uint64_t phase_max_ns[PHASE_COUNT];
+  uint64_t frame_time_hits[FRAME_TIME_BUCKETS];
+  uint64_t presses;               // key presses followed by a presented frame
+  uint64_t input_latency_ns;      // from the press reaching the event watch to that frame's present
+  uint64_t input_latency_max_ns;
+} profile_t;
+
+#define TRACE_MAGIC 0x52543843u   // "C8TR" in a little endian file
+#define TRACE_VERSION 2
+#define TRACE_RING_SIZE (1 << 20) // bytes, a power of two
+
+// Trace record kinds, the first byte of every record
+typedef enum {
+  TRACE_OP,     // instruction at PC: opcode, then the V registers it changed
+  TRACE_SKIP,   // idle loop at PC skipped: cycle count, then the V registers it changed
+  TRACE_FRAME   // 60hz timer tick: delay and sound timers after the tick
+} trace_kind_t;
+
+// Binary trace of everything a machine executes. The emulator is the single producer of a lock free
+// byte ring that a writer thread drains to the file. Records are little endian: the kind byte, then for
+// OP and SKIP a PC word and the kind's fields followed by a 16 bit mask of changed V registers
+// followed by their new values. A record is emitted once the next one starts, so its V changes are known
+typedef struct {
+  uint8_t ring[TRACE_RING_SIZE];
+  _Alignas(64) atomic_size_t head;  // bytes produced, only written by the emulator
+  _Alignas(64) atomic_size_t tail;  // bytes written out, only written by the writer thread
+  atomic_bool stop;
+  FILE *file;
+  SDL_Thread *writer;
+  uint64_t stalls;                  // times the emulator had to wait for ring space
+  
+  // the record waiting for its V changes
+  bool pending;
+  uint8_t pending_kind;
+  uint16_t pending_pc;
+  uint32_t pending_arg;             // opcode or skipped cycles
+  uint8_t last_V[16];               // V at the start of the pending record
+} trace_t;
+
+#define EXPORT_MAGIC 0x58453843u  // "C8EX", lets a consumer check it mapped the right object
+#define EXPORT_VERSION 1
+#define EXPORT_SLOTS 8            // a consumer reading a slot in place has this many frames before it is reused
+
+// One exported frame. sequence is 0 while the slot is being written, so a consumer that reads the same
+// nonzero sequence before and after using the slot knows it saw a whole frame
+typedef struct {
+  atomic_uint_least64_t sequence;
+  uint32_t width;                 // of the active mode, 64x32 or 128x64
+  uint32_t height;
+  union {
+    uint64_t rows[DISPLAY_PLANES][DISPLAY_HEIGHT][DISPLAY_WORDS]; // EXPORT_PACKED, laid out as display_t
+    uint32_t pixels[DISPLAY_HEIGHT][DISPLAY_WIDTH];               // EXPORT_RGBA, width pixels of each row used
+  };
+} export_slot_t;
+
+// Frames published to other processes through shared memory, and the keypad they send back. It holds no
+// pointers, a consumer maps it by name and reads slot latest % EXPORT_SLOTS in place. Nothing waits for
+// consumers, one that falls behind just misses frames
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t format;                // export_format_t
+  uint32_t slot_count;
+  uint32_t palette[1 << DISPLAY_PLANES]; // RGBA8888 colors a packed pixel's plane bits pick
+  atomic_uint_least64_t latest;   // sequence of the newest complete frame, 0 before the first
+  atomic_uint_least16_t keypad;   // written by consumers, added to the keypad before every frame
+  uint16_t reserved[3];
+  export_slot_t slots[EXPORT_SLOTS];
+} export_t;
+
+// Chip8 machine object
+typedef struct chip8 {
   emulator_state_t state;
-  uint8_t ram[4096];
-  bool display[64 * 32];  // keeps track of if each pixel should be on or off
+  bool turbo;             // fast forward, toggled with TAB
+  bool rewinding;         // stepping back through the rewind history, while BACKSPACE is held
+  uint8_t *ram;           // RAM_SIZE bytes plus RAM_SLACK, on the heap so copies of the machine stay small
+  display_t display;
+  uint64_t dirty_rows;    // bitmask of display rows changed since the last screen update
   uint16_t stack[16];      // subroutine stack which typically handles 12 levels of nesting
-  uint16_t *stack_ptr;     // pointer to next open stack location
+  uint8_t stack_top;       // index of next open stack location, an index keeps chip8_t relocatable
   uint8_t V[16];          // data registers V0 - VF
   uint16_t I;             // index register
   uint16_t PC;            // program counter, abstraction for memory address that is being executed
   uint8_t delay_timer;    // decrements at 60hz if above zero
   uint8_t sound_timer;    // decrements at 60hz and plays tone while nonzero
-  bool keypad[16];        // original keypad was 4x4 with keys 0 - F
+  uint8_t quirk_profile;  // quirk_profile_t the handlers are picked for
+  uint16_t keypad;        // original keypad was 4x4 with keys 0 - F, bit n set while key n is down
+  uint8_t planes;         // bitplanes drawn, cleared and scrolled, selected with XO-CHIP FN01
+  uint8_t pitch;          // XO-CHIP FX3A playback pitch of the audio pattern
+  uint8_t audio_pattern[16]; // XO-CHIP F002 one bit samples
+  uint8_t rpl[16];        // SUPER-CHIP RPL user flags, FX75/FX85
   const char *rom_name;   // name of currently loaded ROM
   instruction_t inst;     // currently executing instruction
+  decoded_t *decode_cache; // one entry per ram address for the cached engine, NULL otherwise
+  uint32_t rng;           // xorshift32 state for CXNN, never zero
+  block_cache_t *block_cache; // translated blocks for the block and JIT engines, NULL otherwise
+  jit_t *jit;             // native code buffer for the JIT engine, NULL otherwise
+  profile_t *profile;     // counters when profiling, NULL otherwise
+  trace_t *trace;         // instruction trace when tracing, NULL otherwise
+  export_t *export;       // shared memory frame export, NULL otherwise
 } chip8_t;
 
-// Audio callback function
-void audio_callback(void *userdata, uint8_t *stream, int len) {
-  config_t *config = (config_t *) userdata;
+#ifndef CHIP8_LIBRARY
+// builds the wavetable from the odd harmonics of a square wave that fit below nyquist, so high tones don't alias
+static void audio_init(audio_t *audio, const uint32_t sample_rate, const uint32_t freq, const int16_t volume) {
+  const double pi = 3.14159265358979323846;
+  double wave[WAVETABLE_SIZE];
+  double peak = 0;
+
+  for (int i = 0; i < WAVETABLE_SIZE; i++) {
+    const double t = 2 * pi * i / WAVETABLE_SIZE;
+    wave[i] = 0;
+    for (uint32_t k = 1; k * freq < sample_rate / 2 && k < WAVETABLE_SIZE / 2; k += 2)
+      wave[i] += sin(k * t) / k;
+    if (fabs(wave[i]) > peak) peak = fabs(wave[i]);
+  }
+
+  // scaled by the peak rather than 4/pi so the gibbs overshoot stays within the configured volume
+  for (int i = 0; i < WAVETABLE_SIZE; i++)
+    audio->wavetable[i] = peak > 0 ? (int16_t) lrint(wave[i] / peak * volume) : 0;
+
+  audio->phase = 0;
+  audio->phase_step = (uint32_t) (((uint64_t) freq << 32) / sample_rate);
+  audio->samples_per_tick = sample_rate / FRAME_RATE;
+  atomic_init(&audio->gate, 0);
+}
+
+// Audio callback function, the device runs continuously and the gate decides sample by sample what is audible
+static void audio_callback(void *userdata, uint8_t *stream, int len) {
+  audio_t *audio = (audio_t *) userdata;
   int16_t *data = (int16_t *) stream;
-  static uint32_t running_sample_index = 0;
-  const int32_t square_wave_period = config->audio_sample_rate / config->square_wave_freq;
-  const int32_t half_square_wave_period = square_wave_period / 2;
+  const int samples = len / 2;
+  uint32_t published = atomic_load_explicit(&audio->gate, memory_order_relaxed);
+  uint32_t gate = published;
+  uint32_t phase = audio->phase;
+  int i = 0;
+
+  for (; i < samples && gate; i++, gate--) {
+    data[i] = audio->wavetable[phase >> (32 - WAVETABLE_BITS)];
+    phase += audio->phase_step;
+  }
+  if (i < samples)
+    memset(data + i, 0, (samples - i) * sizeof *data);
+
+  // the phase only advances while audible so every beep starts on the same sample of the wave
+  if (!gate) phase = 0;
+  audio->phase = phase;
+
+  // count down unless the main thread published a newer value while this buffer was being filled
+  atomic_compare_exchange_strong_explicit(&audio->gate, &published, gate, memory_order_relaxed, memory_order_relaxed);
+}
+
+// Keypad bit for each physical key, by scancode so the layout is the same whatever the keyboard language
+// 1 2 3 4      1 2 3 C
+// q w e r  ->  4 5 6 D
+// a s d f      7 8 9 E
+// z x c v      A 0 B F
+static const uint16_t keypad_bits[SDL_NUM_SCANCODES] = {
+  [SDL_SCANCODE_1] = 1 << 0x1, [SDL_SCANCODE_2] = 1 << 0x2, [SDL_SCANCODE_3] = 1 << 0x3, [SDL_SCANCODE_4] = 1 << 0xC,
+  [SDL_SCANCODE_Q] = 1 << 0x4, [SDL_SCANCODE_W] = 1 << 0x5, [SDL_SCANCODE_E] = 1 << 0x6, [SDL_SCANCODE_R] = 1 << 0xD,
+  [SDL_SCANCODE_A] = 1 << 0x7, [SDL_SCANCODE_S] = 1 << 0x8, [SDL_SCANCODE_D] = 1 << 0x9, [SDL_SCANCODE_F] = 1 << 0xE,
+  [SDL_SCANCODE_Z] = 1 << 0xA, [SDL_SCANCODE_X] = 1 << 0x0, [SDL_SCANCODE_C] = 1 << 0xB, [SDL_SCANCODE_V] = 1 << 0xF,
+};
+
+// Event watch, called for every event as it is pumped into the queue so keypad changes don't wait for
+// handle_input. Key repeats are ignored, a held key is already down
+static int input_watch(void *userdata, SDL_Event *event) {
+  input_t *input = (input_t *) userdata;
+  if ((event->type != SDL_KEYDOWN && event->type != SDL_KEYUP) || event->key.repeat) return 1;
+  
+  const uint32_t scancode = event->key.keysym.scancode;
+  const uint16_t bit = scancode < SDL_NUM_SCANCODES ? keypad_bits[scancode] : 0;
+  if (!bit) return 1;
+  
+  if (event->type == SDL_KEYDOWN) {
+    atomic_fetch_or(&input->keypad, bit);
+    atomic_fetch_or(&input->taps, bit);
+    uint_least64_t none = 0;
+    atomic_compare_exchange_strong(&input->pressed, &none, SDL_GetPerformanceCounter());
+  } else {
+    atomic_fetch_and(&input->keypad, (uint16_t) ~bit);
+  }
+  return 1;
+}
+
+// hands the current keypad to the machine. A press it hasn't seen before updates *press, the time of
+// the oldest press whose effect hasn't been presented yet
+static void input_sample(input_t *input, chip8_t *chip8, uint64_t *press) {
+  chip8->keypad = atomic_load(&input->keypad) | atomic_exchange(&input->taps, 0);
+  if (chip8->export) chip8->keypad |= atomic_load_explicit(&chip8->export->keypad, memory_order_relaxed);
+  const uint64_t pressed = atomic_exchange(&input->pressed, 0);
+  if (pressed && !*press) *press = pressed;
+}
+
+// Value types of the options in option_table
+typedef enum {
+  OPTION_FLAG,    // bool set by the bare option, or by true/false/yes/no/on/off/1/0 in a config file
+  OPTION_NUMBER,  // unsigned decimal between min and max, stored in however wide the field is
+  OPTION_COLOR,   // RGBA8888 written as RRGGBBAA hex, optionally with a leading #
+  OPTION_STRING,  // kept as a pointer into argv or into a copy of the config file line
+  OPTION_CHOICE,  // one of choices, stored as its index
+} option_kind_t;
+
+// One setting of config_t, accepted as --name VALUE on the command line and as name = VALUE in a config file
+typedef struct {
+  const char *name;
+  option_kind_t kind;
+  size_t offset;                // of the field in config_t
+  size_t size;                  // of the field, numbers are stored truncated to it
+  uint64_t min, max;            // accepted range of a number
+  const char *const *choices;   // names of a choice's values
+  uint32_t choice_count;
+  const char *hint;             // stands for the value in the usage text
+} option_t;
+
+#define CONFIG_FIELD(field) offsetof(config_t, field), sizeof(((config_t *) 0)->field)
+#define OPTION_FLAG(name, field) {name, OPTION_FLAG, CONFIG_FIELD(field), 0, 1, NULL, 0, NULL}
+#define OPTION_NUMBER(name, field, min, max, hint) {name, OPTION_NUMBER, CONFIG_FIELD(field), min, max, NULL, 0, hint}
+#define OPTION_COLOR(name, field) {name, OPTION_COLOR, CONFIG_FIELD(field), 0, UINT32_MAX, NULL, 0, "RRGGBBAA"}
+#define OPTION_STRING(name, field, hint) {name, OPTION_STRING, CONFIG_FIELD(field), 0, 0, NULL, 0, hint}
+#define OPTION_CHOICE(name, field, names) \
+  {name, OPTION_CHOICE, CONFIG_FIELD(field), 0, 0, names, sizeof names / sizeof names[0], NULL}
+
+// choices are stored as a 32 bit index, which is what these enums are
+_Static_assert(sizeof(renderer_t) == 4 && sizeof(engine_t) == 4 && sizeof(export_format_t) == 4,
+               "choice fields must be 32 bit");
+
+static const option_t option_table[] = {
+  OPTION_STRING("config", config_path, "FILE"),
+  OPTION_CHOICE("renderer", renderer, renderer_names),
+  OPTION_FLAG("vsync", vsync),
+  OPTION_NUMBER("scale", scale_factor, 1, 64, "N"),
+  OPTION_COLOR("foreground", foreground_color),
+  OPTION_COLOR("background", background_color),
+  OPTION_COLOR("plane2-color", plane2_color),
+  OPTION_COLOR("blend-color", blend_color),
+  OPTION_NUMBER("clock", clock_speed, 1, UINT32_MAX, "HZ"),
+  OPTION_NUMBER("turbo", turbo_factor, 1, UINT32_MAX, "N"),
+  OPTION_NUMBER("rewind", rewind_seconds, 0, 86400, "SECONDS"),
+  OPTION_NUMBER("tone", square_wave_freq, 1, 20000, "HZ"),
+  OPTION_NUMBER("sample-rate", audio_sample_rate, 8000, 192000, "HZ"),
+  OPTION_NUMBER("audio-buffer", audio_samples, 16, 32768, "SAMPLES"),
+  OPTION_NUMBER("volume", volume, 0, INT16_MAX, "N"),
+  OPTION_CHOICE("engine", engine, engine_names),
+  OPTION_CHOICE("quirks", quirk_profile, quirk_profile_names),
+  OPTION_FLAG("headless", headless),
+  OPTION_FLAG("precise", precise),
+  OPTION_NUMBER("cycles", max_cycles, 0, UINT64_MAX, "N"),
+  OPTION_NUMBER("frames", max_frames, 0, UINT64_MAX, "N"),
+  OPTION_STRING("library", library_path, "FILE"),
+  OPTION_STRING("pack", pack_path, "FILE"),
+  OPTION_STRING("record", record_path, "FILE"),
+  OPTION_STRING("replay", replay_path, "FILE"),
+  OPTION_FLAG("bench", bench),
+  OPTION_FLAG("precompile", precompile),
+  OPTION_STRING("precompile-cache", precompile_cache, "DIR"),
+  OPTION_NUMBER("serve", serve_port, 1, 65535, "PORT"),
+  OPTION_NUMBER("sessions", max_sessions, 1, 1000000, "N"),
+  OPTION_STRING("trace", trace_path, "FILE"),
+  OPTION_STRING("decode-trace", decode_trace_path, "FILE"),
+  OPTION_FLAG("profile", profile),
+  OPTION_STRING("profile-shm", profile_shm, "NAME"),
+  OPTION_STRING("export-shm", export_shm, "NAME"),
+  OPTION_CHOICE("export-format", export_format, export_format_names),
+  OPTION_NUMBER("repeat", repeat, 1, UINT32_MAX, "N"),
+  OPTION_NUMBER("jobs", jobs, 0, 1024, "N"),
+  OPTION_FLAG("batch", batch),
+  OPTION_NUMBER("seed", seed, 0, UINT32_MAX, "N"),
+};
+
+// prints every option in table order, wrapped to a terminal width
+static void print_usage(const char *program) {
+  int column = fprintf(stderr, "Usage: %s <rom_file>", program);
+  for (uint32_t o = 0; o < sizeof option_table / sizeof option_table[0]; o++) {
+    const option_t *option = &option_table[o];
+    char text[128];
+    int length = snprintf(text, sizeof text, " [--%s", option->name);
+    if (option->kind == OPTION_CHOICE) {
+      for (uint32_t c = 0; c < option->choice_count; c++)
+        length += snprintf(text + length, sizeof text - length, "%c%s", c ? '|' : ' ', option->choices[c]);
+    } else if (option->hint) {
+      length += snprintf(text + length, sizeof text - length, " %s", option->hint);
+    }
+    snprintf(text + length, sizeof text - length, "]");
+    
+    if (column + (int) strlen(text) > 110)
+      column = fprintf(stderr, "\n      ");
+    column += fprintf(stderr, "%s", text);
+  }
+  fprintf(stderr, " [more_rom_files...]\n");
+}
+
+static const option_t *find_option(const char *name) {
+  for (uint32_t o = 0; o < sizeof option_table / sizeof option_table[0]; o++) {
+    if (strcmp(option_table[o].name, name) == 0)
+      return &option_table[o];
+  }
+  return NULL;
+}
+
+// parses an unsigned number of the given base that has to make up all of text
+static bool parse_unsigned(const char *text, const int base, uint64_t *value) {
+  char *end;
+  if (!*text || *text == '-' || *text == '+') return false;
+  *value = strtoull(text, &end, base);
+  return *end == '\0';
+}
+
+// stores value into a config field of any of the integer widths options use
+static void store_field(void *field, const size_t size, const uint64_t value) {
+  if (size == 1) *(uint8_t *) field = value;
+  else if (size == 2) *(uint16_t *) field = value;
+  else if (size == 4) *(uint32_t *) field = value;
+  else *(uint64_t *) field = value;
+}
+
+// parses value for option into config. value is NULL for a flag given on the command line, otherwise it
+// has to stay valid as long as config does. Errors are reported against where, the option or file line
+static bool set_option(config_t *config, const option_t *option, const char *value, const char *where) {
+  void *field = (uint8_t *) config + option->offset;
+  uint64_t number;
+  
+  switch (option->kind) {
+    case OPTION_FLAG:
+      if (!value || strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "on") == 0 ||
+          strcmp(value, "1") == 0) {
+        store_field(field, option->size, 1);
+      } else if (strcmp(value, "false") == 0 || strcmp(value, "no") == 0 || strcmp(value, "off") == 0 ||
+                 strcmp(value, "0") == 0) {
+        store_field(field, option->size, 0);
+      } else {
+        fprintf(stderr, "%s: %s takes true or false, not %s\n", where, option->name, value);
+        return false;
+      }
+      return true;
+    
+    case OPTION_NUMBER:
+      if (!parse_unsigned(value, 10, &number) || number < option->min || number > option->max) {
+        fprintf(stderr, "%s: %s must be a number from %llu to %llu, not %s\n", where, option->name,
+                (unsigned long long) option->min, (unsigned long long) option->max, value);
+        return false;
+      }
+      store_field(field, option->size, number);
+      if (field == &config->seed) config->seed_given = true;
+      return true;
+    
+    case OPTION_COLOR:
+      if (*value == '#') value++;
+      // strtoull alone would also take spaces, a sign or a 0x prefix
+      if (strlen(value) != 8 || strspn(value, "0123456789abcdefABCDEF") != 8 || !parse_unsigned(value, 16, &number)) {
+        fprintf(stderr, "%s: %s must be an RRGGBBAA hex color, not %s\n", where, option->name, value);
+        return false;
+      }
+      store_field(field, option->size, number);
+      return true;
+    
+    case OPTION_STRING:
+      *(const char **) field = value;
+      return true;
+    
+    case OPTION_CHOICE:
+      for (uint32_t c = 0; c < option->choice_count; c++) {
+        if (strcmp(value, option->choices[c]) == 0) {
+          store_field(field, option->size, c);
+          return true;
+        }
+      }
+      fprintf(stderr, "%s: unknown %s: %s\n", where, option->name, value);
+      return false;
+  }
+  return false;
+}
+
+// reads name = value lines into config. Blank lines, # and ; comments and [section] headers are skipped.
+// The lines are kept for the life of the process, string options point into them
+static bool read_config_file(config_t *config, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Unable to open config file: %s\n", path);
+    return false;
+  }
   
-  for (int i = 0; i < len / 2; i++) {
-    data[i] = ((running_sample_index++ / half_square_wave_period) % 2) ? config->volume : -config->volume;
+  char line[1024];
+  uint32_t number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof line, file)) {
+    number++;
+    char where[256];
+    snprintf(where, sizeof where, "%s:%u", path, number);
+    
+    // trims both ends, which also drops the newline
+    char *start = line;
+    while (*start == ' ' || *start == '\t') start++;
+    char *end = start + strlen(start);
+    while (end > start && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) end--;
+    *end = '\0';
+    if (!*start || *start == '#' || *start == ';' || *start == '[') continue;
+    
+    char *equals = strchr(start, '=');
+    if (!equals) {
+      fprintf(stderr, "%s: expected name = value\n", where);
+      ok = false;
+      break;
+    }
+    char *name_end = equals;
+    while (name_end > start && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+    *name_end = '\0';
+    char *value = equals + 1;
+    while (*value == ' ' || *value == '\t') value++;
+    
+    const option_t *option = find_option(start);
+    if (!option || strcmp(start, "config") == 0) {  // config files don't include others
+      fprintf(stderr, "%s: unknown option: %s\n", where, start);
+      ok = false;
+      break;
+    }
+    
+    // only string options keep pointing at the value, so only they need their own copy of it
+    if (option->kind == OPTION_STRING && !(value = strdup(value))) {
+      ok = false;
+      break;
+    }
+    ok = set_option(config, option, value, where);
   }
+  
+  fclose(file);
+  return ok;
 }
 
-bool set_config_from_args(config_t *config, int argc, char **argv) {
+static bool set_config_from_args(config_t *config, int argc, char **argv) {
   // set defaults
   *config = (config_t) {
-    .window_width = 64,
-    .window_height = 32,
+    .window_width = LORES_WIDTH,    // hires pixels are drawn at half the scale
+    .window_height = LORES_HEIGHT,
     .foreground_color = 0xFFFFFFFF, // white pixels
     .background_color = 0x000000FF, // black background
+    .plane2_color = 0xAAAAAAFF,
+    .blend_color = 0x555555FF,
     .scale_factor = 20,             // window will have resolution of 1280x640 by default
+    .turbo_factor = 8,
+    .rewind_seconds = 300,
     .clock_speed = 700,             // 700hz is a standard for running old 80s ROMs
     .square_wave_freq = 440,        // 440hz is middle A
     .audio_sample_rate = 44100,     // 44100 is CD quality audio
-    .volume = 3000
+    .audio_samples = 512,
+    .volume = 3000,
+    .renderer = RENDERER_TEXTURE,
+    .repeat = 1,
+    .jobs = 1,
+    .quirk_profile = -1,
+    .max_sessions = 1024,
+#ifdef DEBUG
+    .trace_path = "chip8.trace",    // debug builds always trace, decode with --decode-trace
+#endif
   };
   
-  // TODO: override from program arguments
-  (void) argc;
-  (void) argv;
+  // a config file sits between the defaults and the command line, so it has to be found first. Values
+  // are stepped over the same way the command line is parsed, so one that reads --config isn't taken for it
+  for (int i = 1; i + 1 < argc; i++) {
+    if (strncmp(argv[i], "--", 2) != 0) continue;
+    const option_t *option = find_option(argv[i] + 2);
+    if (!option) continue;
+    if (strcmp(option->name, "config") == 0) {
+      config->config_path = argv[i + 1];
+      if (!read_config_file(config, config->config_path)) return false;
+      break;
+    }
+    if (option->kind != OPTION_FLAG) i++;
+  }
+  
+  // ROM files can go anywhere among the options, usually argv[1] is the first
+  config->roms = malloc(argc * sizeof(char *));
+  if (config->roms == NULL) return false;
+  
+  // override from program arguments
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) != 0) {
+      config->roms[config->rom_count++] = argv[i];
+      continue;
+    }
+    
+    const option_t *option = find_option(argv[i] + 2);
+    if (!option || (option->kind != OPTION_FLAG && i + 1 >= argc)) {
+      fprintf(stderr, "Unknown or incomplete argument: %s\n", argv[i]);
+      return false;
+    }
+    const char *name = argv[i];
+    const char *value = option->kind == OPTION_FLAG ? NULL : argv[++i];
+    if (!set_option(config, option, value, name)) return false;
+  }
+  
+  // options that only make sense with another one turn it on
+  if (config->replay_path) config->headless = true;
+  if (config->profile_shm) config->profile = true;
+  if (config->serve_port) config->headless = true;
+  if (config->precompile_cache) config->precompile = true;
+  
+  // lockstep batches only run plain headless instances, rather than being quietly ignored elsewhere
+  if (config->batch && (!config->headless || config->serve_port || config->library_path)) {
+    fprintf(stderr, "--batch needs --headless and can't be used with --serve or --library\n");
+    return false;
+  }
+  
+  // an input log drives exactly one machine, the multi-instance runners and the server would drop it
+  if (config->replay_path && (config->rom_count > 1 || config->repeat > 1 || config->jobs != 1 || config->batch ||
+                              config->serve_port || config->bench)) {
+    fprintf(stderr, "--replay plays back one ROM and can't be used with --repeat, --jobs, --batch, --serve or --bench\n");
+    return false;
+  }
   
   return true;
 }
 
-bool sdl_init(sdl_t *sdl, config_t *config) {
+// splits an RGBA8888 config color into the components SDL draw calls take
+static SDL_Color color_from_rgba(const uint32_t rgba) {
+  return (SDL_Color) {
+    .r = rgba >> 24 & 0xFF,
+    .g = rgba >> 16 & 0xFF,
+    .b = rgba >> 8 & 0xFF,
+    .a = rgba & 0xFF
+  };
+}
+
+static bool sdl_init(sdl_t *sdl, config_t *config) {
+  // palette is split up once here instead of on every frame
+  const uint32_t palette[1 << DISPLAY_PLANES] = {config->background_color, config->foreground_color,
+                                                  config->plane2_color, config->blend_color};
+  for (uint32_t i = 0; i < 1 << DISPLAY_PLANES; i++) {
+    sdl->palette[i] = palette[i];
+    sdl->colors[i] = color_from_rgba(palette[i]);
+  }
+  
   uint32_t init_flags = SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER;
   if (SDL_Init(init_flags) != 0) {
     SDL_Log("Unable to initialize SDL: %s\n", SDL_GetError());
@@ -113,20 +882,33 @@ bool sdl_init(sdl_t *sdl, config_t *config) {
   }
   
   // creating renderer
-  sdl->renderer = SDL_CreateRenderer(sdl->window, -1, 0);
+  sdl->renderer = SDL_CreateRenderer(sdl->window, -1, config->vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
   if (sdl->renderer == NULL) {
     SDL_Log("Unable to create renderer: %s\n", SDL_GetError());
     return false;
   }
   
+  // creating framebuffer texture, config colors are already RGBA8888 so pixels can be written as-is
+  if (config->renderer == RENDERER_TEXTURE) {
+    sdl->texture = SDL_CreateTexture(sdl->renderer,
+                                     SDL_PIXELFORMAT_RGBA8888,
+                                     SDL_TEXTUREACCESS_STREAMING,
+                                     DISPLAY_WIDTH,
+                                     DISPLAY_HEIGHT);
+    if (sdl->texture == NULL) {
+      SDL_Log("Unable to create framebuffer texture: %s\n", SDL_GetError());
+      return false;
+    }
+  }
+  
   // creating audio spec
   sdl->want = (SDL_AudioSpec) {
     .freq = config->audio_sample_rate,
     .format = AUDIO_S16LSB, // signed 16bit little-endian
     .channels = 1,          // mono
-    .samples = 512,
+    .samples = config->audio_samples,
     .callback = audio_callback,
-    .userdata = config
+    .userdata = &sdl->audio
   };
   
   sdl->device = SDL_OpenAudioDevice(NULL, 0, &sdl->want, &sdl->have, 0);
@@ -141,10 +923,18 @@ bool sdl_init(sdl_t *sdl, config_t *config) {
     return false;
   }
   
+  SDL_AddEventWatch(input_watch, &sdl->input);
+  
+  // the callback isn't running until the device is unpaused, and from then on it stays unpaused
+  audio_init(&sdl->audio, sdl->have.freq, config->square_wave_freq, config->volume);
+  SDL_PauseAudioDevice(sdl->device, 0);
+  
   return true;
 }
+#endif
 
-bool chip8_init(chip8_t *chip8, const char *rom_name) {
+// resets the machine and loads a ROM image that is already in memory
+static bool chip8_load(chip8_t *chip8, const char *rom_name, const uint8_t *rom, const size_t rom_size) {
   const uint16_t entry_point = 0x200;  // chip8 ROMs load to 0x200
   const uint8_t font[80] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -165,117 +955,722 @@ bool chip8_init(chip8_t *chip8, const char *rom_name) {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
   };
   
-  // initialize empty chip8 machine
-  memset(chip8, 0, sizeof(chip8_t));
-  
-  // load font
-  memcpy(chip8->ram, font, sizeof(font)); // font is loaded into beginning of memory
-  
-  // open ROM file
-  FILE *rom_file = fopen(rom_name, "rb");  // open ROM file in binary read mode
-  if (rom_file == NULL) {
-    SDL_Log("Unable to open ROM file: %s\n", rom_name);
-    return false;
-  }
+  const uint8_t big_font[160] = {  // SUPER-CHIP 8x10 digits, XO-CHIP adds A - F
+    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+  };
   
-  // check ROM size
-  fseek(rom_file, 0, SEEK_END);
-  const size_t rom_size = ftell(rom_file);
-  const size_t max_size = sizeof chip8->ram - entry_point;
+  const size_t max_size = RAM_SIZE - entry_point;
   if (rom_size > max_size) {
     SDL_Log("Rom file %s is too large. Size: %zu, Maximum: %zu\n", rom_name, rom_size, max_size);
     return false;
   }
   
-  // load ROM into memory
-  rewind(rom_file); // to reset file position indicator from fseek above
-  if (fread(&chip8->ram[entry_point], rom_size, 1, rom_file) != 1) {
-    SDL_Log("Failed to load ROM into memory.\n");
+  uint8_t *ram = calloc(1, RAM_SIZE + RAM_SLACK);
+  if (!ram) {
+    SDL_Log("Unable to allocate memory for %s\n", rom_name);
     return false;
   }
   
-  // close ROM file
-  fclose(rom_file);
+  // initialize empty chip8 machine
+  memset(chip8, 0, sizeof(chip8_t));
+  chip8->ram = ram;
+  
+  // load fonts
+  memcpy(chip8->ram, font, sizeof(font)); // font is loaded into beginning of memory
+  memcpy(&chip8->ram[BIG_FONT], big_font, sizeof(big_font));
+  
+  // load ROM into memory
+  memcpy(&chip8->ram[entry_point], rom, rom_size);
   
   // default machine state
   chip8->state = RUNNING;
-  chip8->stack_ptr = chip8->stack;
+  chip8->dirty_rows = UINT64_MAX; // first frame always gets drawn
+  chip8->planes = 1;
   chip8->PC = entry_point;
   chip8->rom_name = rom_name;
   
   return true;
 }
 
-void handle_input(chip8_t *chip8) {
-  SDL_Event event = {0};
-  while (SDL_PollEvent(&event)) {
-    switch (event.type) {
-      case SDL_KEYUP:
-        switch (event.key.keysym.sym) {
-          case SDLK_1:
-            chip8->keypad[0x1] = false;
-            break;
-  
-          case SDLK_2:
-            chip8->keypad[0x2] = false;
-            break;
+// A whole file mapped read only, or read into memory where mmap isn't available
+typedef struct {
+  const uint8_t *data;    // NULL for an empty file
+  size_t size;
+} mapped_file_t;
+
+#ifndef CHIP8_LIBRARY
+static bool map_file(const char *path, mapped_file_t *file) {
+  *file = (mapped_file_t) {0};
+#ifdef MMAP_SUPPORTED
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
   
-          case SDLK_3:
-            chip8->keypad[0x3] = false;
-            break;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  if (ok && st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ok = data != MAP_FAILED;
+    if (ok) *file = (mapped_file_t) {.data = data, .size = st.st_size};
+  }
+  close(fd);
+  return ok;
+#else
+  FILE *handle = fopen(path, "rb");
+  if (handle == NULL) return false;
   
-          case SDLK_4:
-            chip8->keypad[0xC] = false;
-            break;
+  fseek(handle, 0, SEEK_END);
+  const long size = ftell(handle);
+  rewind(handle);
+  uint8_t *data = size > 0 ? malloc(size) : NULL;
+  const bool ok = size == 0 || (data && fread(data, size, 1, handle) == 1);
+  fclose(handle);
+  if (!ok) {
+    free(data);
+    return false;
+  }
+  *file = (mapped_file_t) {.data = data, .size = size};
+  return true;
+#endif
+}
+
+static void unmap_file(mapped_file_t *file) {
+  if (!file->data) return;
+#ifdef MMAP_SUPPORTED
+  munmap((void *) file->data, file->size);
+#else
+  free((void *) file->data);
+#endif
+  *file = (mapped_file_t) {0};
+}
+
+static bool chip8_init(chip8_t *chip8, const char *rom_name) {
+  mapped_file_t rom;
+  if (!map_file(rom_name, &rom)) {
+    SDL_Log("Unable to open ROM file: %s\n", rom_name);
+    return false;
+  }
   
-          case SDLK_q:
-            chip8->keypad[0x4] = false;
-            break;
+  const bool ok = chip8_load(chip8, rom_name, rom.data, rom.size);
+  unmap_file(&rom);
+  return ok;
+}
+#endif
+
+#define LIBRARY_MAGIC 0x424C3843u  // "C8LB" in a little endian file
+#define LIBRARY_VERSION 1
+#define LIBRARY_NAME_SIZE 48
+
+// ROM library archive header, followed by count index entries and then the ROM images
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t reserved;
+} library_header_t;
+
+// Index entry of one ROM in a library
+typedef struct {
+  uint64_t hash;                  // FNV-1a of the ROM image, identifies a ROM whatever its file name
+  uint32_t offset;                // of the image from the start of the archive
+  uint32_t size;
+  uint8_t quirks;                 // quirk profile the ROM expects, 0 when unknown
+  uint8_t reserved[7];
+  char name[LIBRARY_NAME_SIZE];   // file name it was packed from, always NUL terminated
+} library_entry_t;
+
+// A mapped ROM library, its images are loaded into the machine straight from the mapping
+typedef struct {
+  mapped_file_t file;
+  const library_entry_t *entries;
+  uint32_t count;
+  uint32_t current;               // index of the loaded ROM
+} library_t;
+
+#ifndef CHIP8_LIBRARY
+static uint64_t rom_hash(const uint8_t *data, const size_t size) {
+  uint64_t hash = 0xCBF29CE484222325;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001B3;
+  }
+  return hash;
+}
+
+// maps a library and checks the whole index, so entries can be trusted afterwards
+static bool library_open(library_t *library, const char *path) {
+  *library = (library_t) {0};
+  if (!map_file(path, &library->file)) {
+    SDL_Log("Unable to open ROM library: %s\n", path);
+    return false;
+  }
   
-          case SDLK_w:
-            chip8->keypad[0x5] = false;
-            break;
+  const mapped_file_t *file = &library->file;
+  const library_header_t *header = (const library_header_t *) file->data;
+  bool ok = file->size >= sizeof *header && header->magic == LIBRARY_MAGIC && header->version == LIBRARY_VERSION &&
+            header->count > 0 && header->count <= (file->size - sizeof *header) / sizeof(library_entry_t);
   
-          case SDLK_e:
-            chip8->keypad[0x6] = false;
-            break;
+  if (ok) {
+    library->entries = (const library_entry_t *) (file->data + sizeof *header);
+    library->count = header->count;
+    for (uint32_t i = 0; i < library->count && ok; i++) {
+      const library_entry_t *entry = &library->entries[i];
+      ok = entry->offset <= file->size && entry->size <= file->size - entry->offset &&
+           memchr(entry->name, '\0', LIBRARY_NAME_SIZE) != NULL;
+    }
+  }
   
-          case SDLK_r:
-            chip8->keypad[0xD] = false;
-            break;
+  if (!ok) {
+    SDL_Log("Not a valid ROM library: %s\n", path);
+    unmap_file(&library->file);
+    return false;
+  }
+  return true;
+}
+
+static void library_close(library_t *library) {
+  unmap_file(&library->file);
+}
+
+// index of the entry with this name, or count if there is none
+static uint32_t library_find(const library_t *library, const char *name) {
+  uint32_t i = 0;
+  while (i < library->count && strcmp(library->entries[i].name, name) != 0)
+    i++;
+  return i;
+}
+
+// quirk profile a library ROM runs with, --quirks overrides the one stored with it
+static quirk_profile_t library_quirks(const library_entry_t *entry, const config_t *config) {
+  if (config->quirk_profile >= 0) return config->quirk_profile;
+  return entry->quirks < QUIRK_PROFILE_COUNT ? entry->quirks : QUIRKS_DEFAULT;
+}
+
+// writes every given ROM file into a new library archive, each tagged with the quirk profile to run it with
+static bool library_pack(const char *path, const char **roms, const uint32_t rom_count, const quirk_profile_t quirks) {
+  library_entry_t *entries = calloc(rom_count ? rom_count : 1, sizeof(library_entry_t));
+  mapped_file_t *images = calloc(rom_count ? rom_count : 1, sizeof(mapped_file_t));
+  FILE *archive = NULL;
+  bool ok = entries && images && rom_count;
+  if (!rom_count) SDL_Log("No ROM files to pack\n");
   
-          case SDLK_a:
-            chip8->keypad[0x7] = false;
-            break;
+  uint32_t offset = sizeof(library_header_t) + rom_count * sizeof(library_entry_t);
+  for (uint32_t i = 0; i < rom_count && ok; i++) {
+    if (!map_file(roms[i], &images[i])) {
+      SDL_Log("Unable to open ROM file: %s\n", roms[i]);
+      ok = false;
+      break;
+    }
+    
+    const char *slash = strrchr(roms[i], '/');
+    const char *name = slash ? slash + 1 : roms[i];
+    if (strlen(name) >= LIBRARY_NAME_SIZE) {
+      SDL_Log("ROM file name is longer than %u characters: %s\n", LIBRARY_NAME_SIZE - 1, name);
+      ok = false;
+      break;
+    }
+    
+    entries[i] = (library_entry_t) {
+      .hash = rom_hash(images[i].data, images[i].size),
+      .offset = offset,
+      .size = images[i].size,
+      .quirks = quirks,
+    };
+    strcpy(entries[i].name, name);
+    offset += images[i].size;
+  }
   
-          case SDLK_s:
-            chip8->keypad[0x8] = false;
-            break;
+  if (ok) {
+    const library_header_t header = {.magic = LIBRARY_MAGIC, .version = LIBRARY_VERSION, .count = rom_count};
+    archive = fopen(path, "wb");
+    ok = archive && fwrite(&header, sizeof header, 1, archive) == 1 &&
+         fwrite(entries, sizeof(library_entry_t), rom_count, archive) == rom_count;
+    for (uint32_t i = 0; i < rom_count && ok; i++)
+      ok = images[i].size == 0 || fwrite(images[i].data, images[i].size, 1, archive) == 1;
+    if (archive && fclose(archive) != 0) ok = false;
+    if (!ok) SDL_Log("Failed to write ROM library: %s\n", path);
+  }
   
-          case SDLK_d:
-            chip8->keypad[0x9] = false;
-            break;
+  for (uint32_t i = 0; images && i < rom_count; i++)
+    unmap_file(&images[i]);
+  free(images);
+  free(entries);
+  return ok;
+}
+#endif
+
+// seeds the CXNN generator, every seed including 0 maps to a usable nonzero state
+static void chip8_seed(chip8_t *chip8, const uint32_t seed) {
+  uint32_t state = seed * 0x9E3779B9u + 0x7F4A7C15u;
+  state ^= state >> 16;
+  chip8->rng = state ? state : 1;
+}
+
+// xorshift32, a few cycles per number and good enough for chip8 games
+static inline uint32_t random_next(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+// allocates whatever per-machine state the configured engine needs
+static bool engine_init(chip8_t *chip8, config_t *config) {
+  chip8->quirk_profile = config->quirk_profile < 0 ? QUIRKS_DEFAULT : config->quirk_profile;
   
-          case SDLK_f:
-            chip8->keypad[0xE] = false;
-            break;
+  // native blocks run without stopping between instructions, so there is nothing to trace them with
+  if (config->engine == ENGINE_JIT && config->trace_path) {
+    SDL_Log("Tracing runs on the block engine instead of the JIT\n");
+    config->engine = ENGINE_BLOCK;
+  }
   
-          case SDLK_z:
-            chip8->keypad[0xA] = false;
-            break;
+#ifdef JIT_SUPPORTED
+  if (config->engine == ENGINE_JIT) {
+    // 1MB fits thousands of blocks, the whole buffer is flushed when it runs out
+    const size_t size = 1 << 20;
+    void *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    chip8->jit = code == MAP_FAILED ? NULL : calloc(1, sizeof(jit_t));
+    if (chip8->jit) {
+      *chip8->jit = (jit_t) {.code = code, .size = size};
+    } else {
+      if (code != MAP_FAILED) munmap(code, size);
+      SDL_Log("Unable to allocate executable memory, falling back to the block engine\n");
+      config->engine = ENGINE_BLOCK;
+    }
+  }
+#else
+  if (config->engine == ENGINE_JIT) {
+    SDL_Log("JIT engine is not supported on this host, falling back to the block engine\n");
+    config->engine = ENGINE_BLOCK;
+  }
+#endif
   
-          case SDLK_x:
-            chip8->keypad[0x0] = false;
-            break;
+
+  if (config->engine == ENGINE_CACHED) {
+    chip8->decode_cache = calloc(RAM_SIZE, sizeof(decoded_t));
+    if (chip8->decode_cache == NULL) {
+      SDL_Log("Unable to allocate decode cache\n");
+      return false;
+    }
+  }
   
-          case SDLK_c:
-            chip8->keypad[0xB] = false;
-            break;
+  if (config->engine == ENGINE_BLOCK || config->engine == ENGINE_JIT) {
+    chip8->block_cache = calloc(1, sizeof(block_cache_t));
+    if (chip8->block_cache == NULL) {
+      SDL_Log("Unable to allocate block cache\n");
+      return false;
+    }
+  }
   
-          case SDLK_v:
-            chip8->keypad[0xF] = false;
-            break;
+  return true;
+}
+
+static void chip8_finish(chip8_t *chip8) {
+  free(chip8->ram);
+  chip8->ram = NULL;
+  free(chip8->decode_cache);
+  chip8->decode_cache = NULL;
+  
+  if (chip8->block_cache) {
+    for (uint32_t a = 0; a < RAM_SIZE; a++)
+      free(chip8->block_cache->blocks[a]);
+    free(chip8->block_cache);
+    chip8->block_cache = NULL;
+  }
+  
+#ifdef JIT_SUPPORTED
+  if (chip8->jit) {
+    munmap(chip8->jit->code, chip8->jit->size);
+    free(chip8->jit);
+    chip8->jit = NULL;
+  }
+#endif
+}
+
+// drops cached decodes and blocks overlapping a ram write, including the instruction starting one byte before it.
+// Writes that run past the end of ram wrap to its start, like I plus an offset does
+static void invalidate_code(chip8_t *chip8, const uint16_t address, const uint32_t length) {
+  if ((uint32_t) address + length > RAM_SIZE)
+    invalidate_code(chip8, 0, length < RAM_SIZE ? address + length - RAM_SIZE : RAM_SIZE);
+  const uint32_t end = (uint32_t) address + length < RAM_SIZE ? (uint32_t) address + length : RAM_SIZE;
+  
+  if (chip8->decode_cache) {
+    chip8->decode_cache[(address - 1u) & RAM_MASK].handler = NULL;
+    for (uint32_t a = address; a < end; a++)
+      chip8->decode_cache[a].handler = NULL;
+  }
+  
+  if (chip8->block_cache) {
+    block_cache_t *cache = chip8->block_cache;
+    
+    // most stores hit data, so only go looking for blocks when a written byte was translated from
+    bool hit = false;
+    for (uint32_t a = address; a < end; a++) {
+      hit |= cache->code[a];
+      cache->code[a] = false;
+    }
+    if (!hit) return;
+    
+    // blocks are only marked stale here, never freed, since the store may be the last op of a running block
+    const uint32_t first = address > 2 * MAX_BLOCK_LENGTH ? address - 2 * MAX_BLOCK_LENGTH : 0;
+    for (uint32_t start = first; start < end; start++) {
+      block_t *block = cache->blocks[start];
+      if (block && block->length && start + 2u * block->length > address)
+        block->length = 0;
+    }
+  }
+}
+
+#ifndef CHIP8_LIBRARY
+// allocates the profile, in a named shared memory object when one is configured so a viewer can map it
+static bool profile_init(chip8_t *chip8, const config_t *config) {
+  if (!config->profile) return true;
+  
+  profile_t *profile = NULL;
+  if (config->profile_shm) {
+#ifdef MMAP_SUPPORTED
+    const int fd = shm_open(config->profile_shm, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && ftruncate(fd, sizeof(profile_t)) == 0) {
+      void *map = mmap(NULL, sizeof(profile_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      profile = map == MAP_FAILED ? NULL : map;
+    }
+    if (fd >= 0) close(fd);
+    if (!profile) {
+      SDL_Log("Unable to create shared memory profile %s\n", config->profile_shm);
+      return false;
+    }
+    memset(profile, 0, sizeof(profile_t));
+#else
+    SDL_Log("Shared memory profiles are not supported on this host\n");
+    return false;
+#endif
+  } else {
+    profile = calloc(1, sizeof(profile_t));
+    if (!profile) {
+      SDL_Log("Unable to allocate profile\n");
+      return false;
+    }
+  }
+  
+  profile->magic = PROFILE_MAGIC;
+  profile->version = PROFILE_VERSION;
+  chip8->profile = profile;
+  return true;
+}
+
+static void profile_finish(chip8_t *chip8, const config_t *config) {
+  if (!chip8->profile) return;
+#ifdef MMAP_SUPPORTED
+  if (config->profile_shm) {
+    munmap(chip8->profile, sizeof(profile_t));
+    shm_unlink(config->profile_shm);
+    chip8->profile = NULL;
+    return;
+  }
+#else
+  (void) config;
+#endif
+  free(chip8->profile);
+  chip8->profile = NULL;
+}
+
+// adds time spent in one phase, in nanoseconds. Emulate and sleep are timed by the emulation thread and
+// render and present by the window thread, so every counter has a single writer
+static void profile_phase(profile_t *profile, const phase_t phase, const uint64_t ns) {
+  profile->phase_ns[phase] += ns;
+  if (ns > profile->phase_max_ns[phase])
+    profile->phase_max_ns[phase] = ns;
+}
+
+// counts one emulated frame of the windowed loop, from one deadline to the next
+static void profile_frame(profile_t *profile, const uint64_t frame_ns) {
+  const uint64_t bucket = frame_ns / 1000000;
+  profile->frame_time_hits[bucket < FRAME_TIME_BUCKETS ? bucket : FRAME_TIME_BUCKETS - 1]++;
+  profile->frames++;
+}
+
+// adds the input to photon latency of one key press, in nanoseconds
+static void profile_press(profile_t *profile, const uint64_t latency_ns) {
+  profile->presses++;
+  profile->input_latency_ns += latency_ns;
+  if (latency_ns > profile->input_latency_max_ns)
+    profile->input_latency_max_ns = latency_ns;
+}
+
+// opcodes that run the same handler share a class, keyed by the opcode with its operands masked off
+static uint16_t opcode_class(const uint16_t opcode) {
+  switch (opcode >> 12) {
+    case 0x0:
+      if ((opcode & 0xFFE0) == 0x00C0) return opcode & 0xFFF0; // 00CN and 00DN scrolls
+      return opcode == 0x00E0 || opcode == 0x00EE || (opcode >= 0x00FB && opcode <= 0x00FF) ? opcode : 0x0000;
+    case 0x5: case 0x8: case 0x9: return opcode & 0xF00F;
+    case 0xE: case 0xF: return opcode & 0xF0FF;
+    default: return opcode & 0xF000;
+  }
+}
+
+// writes a class key the way opcodes are usually spelled, like 8XY4 or FX33
+static void opcode_class_name(const uint16_t key, char name[5]) {
+  switch (key >> 12) {
+    case 0x0:
+      if (key == 0x00C0 || key == 0x00D0) snprintf(name, 5, "00%XN", key >> 4 & 0xF);
+      else snprintf(name, 5, key ? "%04X" : "0NNN", key);
+      break;
+    case 0x3: case 0x4: case 0x6: case 0x7: case 0xC: snprintf(name, 5, "%XXNN", key >> 12); break;
+    case 0x5: case 0x8: case 0x9: snprintf(name, 5, "%XXY%X", key >> 12, key & 0xF); break;
+    case 0xD: snprintf(name, 5, "DXYN"); break;
+    case 0xE: case 0xF: snprintf(name, 5, "%XX%02X", key >> 12, key & 0xFF); break;
+    default: snprintf(name, 5, "%XNNN", key >> 12); break;
+  }
+}
+
+// an opcode class or address with its count, for sorting the dump
+typedef struct {
+  uint64_t hits;
+  uint32_t key;
+} hit_count_t;
+
+static int compare_hits_desc(const void *a, const void *b) {
+  const uint64_t x = ((const hit_count_t *) a)->hits, y = ((const hit_count_t *) b)->hits;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// prints the profile to stderr: opcode classes by count, the hottest addresses and frame phase timings
+static void profile_dump(const profile_t *profile) {
+  static const char *const phase_names[PHASE_COUNT] = {"emulate", "render", "present", "sleep"};
+  const uint64_t total = profile->instructions ? profile->instructions : 1;
+  
+  fprintf(stderr, "=== PROFILE ===\ninstructions=%llu idle_cycles=%llu frames=%llu\n",
+          (unsigned long long) profile->instructions, (unsigned long long) profile->idle_cycles,
+          (unsigned long long) profile->frames);
+  
+  // class counts are indexed by class key, then sorted with the key alongside
+  hit_count_t *counts = calloc(65536, sizeof(hit_count_t));
+  if (!counts) return;
+  for (uint32_t op = 0; op < 65536; op++) {
+    counts[opcode_class(op)].hits += profile->opcode_hits[op];
+    counts[op].key = op;
+  }
+  qsort(counts, 65536, sizeof(hit_count_t), compare_hits_desc);
+  
+  fprintf(stderr, "opcodes:\n");
+  for (uint32_t i = 0; i < 65536 && counts[i].hits; i++) {
+    char name[5];
+    opcode_class_name(counts[i].key, name);
+    fprintf(stderr, "  %s %12llu %6.2f%%\n", name, (unsigned long long) counts[i].hits, 100.0 * counts[i].hits / total);
+  }
+  
+  for (uint32_t a = 0; a < RAM_SIZE; a++)
+    counts[a] = (hit_count_t) {.hits = profile->pc_hits[a], .key = a};
+  qsort(counts, RAM_SIZE, sizeof(hit_count_t), compare_hits_desc);
+  
+  fprintf(stderr, "hottest addresses:\n");
+  for (uint32_t i = 0; i < 16 && counts[i].hits; i++)
+    fprintf(stderr, "  0x%04X %12llu %6.2f%%\n", counts[i].key, (unsigned long long) counts[i].hits,
+            100.0 * counts[i].hits / total);
+  free(counts);
+  
+  if (!profile->frames) return;
+  fprintf(stderr, "frame phases (average / max us):\n");
+  for (uint32_t phase = 0; phase < PHASE_COUNT; phase++)
+    fprintf(stderr, "  %-8s %9.1f %9.1f\n", phase_names[phase], profile->phase_ns[phase] / 1e3 / profile->frames,
+            profile->phase_max_ns[phase] / 1e3);
+  fprintf(stderr, "frame times (ms: frames):\n");
+  for (uint32_t bucket = 0; bucket < FRAME_TIME_BUCKETS; bucket++) {
+    if (profile->frame_time_hits[bucket])
+      fprintf(stderr, "  %2u%s %llu\n", bucket, bucket == FRAME_TIME_BUCKETS - 1 ? "+" : " ",
+              (unsigned long long) profile->frame_time_hits[bucket]);
+  }
+  if (profile->presses)
+    fprintf(stderr, "input to photon (average / max ms over %llu presses): %.2f %.2f\n",
+            (unsigned long long) profile->presses, profile->input_latency_ns / 1e6 / profile->presses,
+            profile->input_latency_max_ns / 1e6);
+}
+#endif
+
+// loads another ROM into a running machine, keeping the engine caches, profile and trace attached
+static bool chip8_reload(chip8_t *chip8, const char *rom_name, const uint8_t *rom, const size_t rom_size) {
+  chip8_t fresh;
+  if (!chip8_load(&fresh, rom_name, rom, rom_size)) return false;
+  
+  fresh.turbo = chip8->turbo;
+  fresh.quirk_profile = chip8->quirk_profile;
+  fresh.decode_cache = chip8->decode_cache;
+  fresh.block_cache = chip8->block_cache;
+  fresh.jit = chip8->jit;
+  fresh.profile = chip8->profile;
+  fresh.trace = chip8->trace;
+  fresh.export = chip8->export;
+  free(chip8->ram);
+  *chip8 = fresh;
+  
+  invalidate_code(chip8, 0, RAM_SIZE);
+  return true;
+}
+
+#define SAVESTATE_MAGIC 0x38504843u  // "CHP8" in a little endian file
+#define SAVESTATE_VERSION 2
+
+// Everything needed to resume a machine, with no pointers so it can be written out or diffed as bytes.
+// Fields are ordered so there is no implicit padding, which would otherwise leak into files and deltas
+typedef struct {
+  uint32_t magic;
+  uint32_t version;       // bumped whenever the layout changes, older states are rejected
+  uint64_t display[DISPLAY_PLANES][DISPLAY_HEIGHT][DISPLAY_WORDS];
+  uint8_t ram[RAM_SIZE];
+  uint16_t stack[16];
+  uint32_t rng;
+  uint16_t I;
+  uint16_t PC;
+  uint16_t keypad;        // bit n set while key n is down
+  uint8_t V[16];
+  uint8_t stack_top;
+  uint8_t delay_timer;
+  uint8_t sound_timer;
+  uint8_t hires;
+  uint8_t planes;
+  uint8_t pitch;
+  uint8_t audio_pattern[16];
+  uint8_t rpl[16];
+} savestate_t;
+
+#ifndef CHIP8_LIBRARY
+static void chip8_save(const chip8_t *chip8, savestate_t *state) {
+  *state = (savestate_t) {
+    .magic = SAVESTATE_MAGIC,
+    .version = SAVESTATE_VERSION,
+    .rng = chip8->rng,
+    .I = chip8->I,
+    .PC = chip8->PC,
+    .keypad = chip8->keypad,
+    .stack_top = chip8->stack_top,
+    .delay_timer = chip8->delay_timer,
+    .sound_timer = chip8->sound_timer,
+    .hires = chip8->display.hires,
+    .planes = chip8->planes,
+    .pitch = chip8->pitch,
+  };
+  memcpy(state->display, chip8->display.rows, sizeof state->display);
+  memcpy(state->ram, chip8->ram, sizeof state->ram);
+  memcpy(state->stack, chip8->stack, sizeof state->stack);
+  memcpy(state->V, chip8->V, sizeof state->V);
+  memcpy(state->audio_pattern, chip8->audio_pattern, sizeof state->audio_pattern);
+  memcpy(state->rpl, chip8->rpl, sizeof state->rpl);
+}
+
+// loads a snapshot into a running machine, only the ram that differs has its cached code dropped
+static bool chip8_restore(chip8_t *chip8, const savestate_t *state) {
+  if (state->magic != SAVESTATE_MAGIC || state->version != SAVESTATE_VERSION) {
+    SDL_Log("Save state is not from this version of the emulator\n");
+    return false;
+  }
+  
+  for (uint32_t a = 0; a < RAM_SIZE; ) {
+    if (chip8->ram[a] == state->ram[a]) {
+      a++;
+      continue;
+    }
+    const uint32_t start = a;
+    while (a < RAM_SIZE && chip8->ram[a] != state->ram[a]) a++;
+    memcpy(&chip8->ram[start], &state->ram[start], a - start);
+    invalidate_code(chip8, start, a - start);
+  }
+  
+  memcpy(chip8->display.rows, state->display, sizeof chip8->display.rows);
+  memcpy(chip8->stack, state->stack, sizeof chip8->stack);
+  memcpy(chip8->V, state->V, sizeof chip8->V);
+  memcpy(chip8->audio_pattern, state->audio_pattern, sizeof chip8->audio_pattern);
+  memcpy(chip8->rpl, state->rpl, sizeof chip8->rpl);
+  chip8->display.hires = state->hires;
+  chip8->planes = state->planes;
+  chip8->pitch = state->pitch;
+  chip8->keypad = state->keypad;
+  chip8->rng = state->rng;
+  chip8->I = state->I;
+  chip8->PC = state->PC;
+  chip8->stack_top = state->stack_top;
+  chip8->delay_timer = state->delay_timer;
+  chip8->sound_timer = state->sound_timer;
+  chip8->dirty_rows = UINT64_MAX;
+  return true;
+}
+
+// quick save slot next to the ROM, <rom>.state
+static void state_path(const chip8_t *chip8, char *path, const size_t size) {
+  snprintf(path, size, "%s.state", chip8->rom_name);
+}
+
+static bool save_state_file(const chip8_t *chip8) {
+  char path[4096];
+  state_path(chip8, path, sizeof path);
   
+  savestate_t state;
+  chip8_save(chip8, &state);
+  
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    SDL_Log("Unable to open save state file: %s\n", path);
+    return false;
+  }
+  const bool ok = fwrite(&state, sizeof state, 1, file) == 1;
+  if (fclose(file) != 0 || !ok) {
+    SDL_Log("Failed to write save state file: %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+static bool load_state_file(chip8_t *chip8) {
+  char path[4096];
+  state_path(chip8, path, sizeof path);
+  
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    SDL_Log("Unable to open save state file: %s\n", path);
+    return false;
+  }
+  savestate_t state;
+  const bool ok = fread(&state, sizeof state, 1, file) == 1;
+  fclose(file);
+  if (!ok) {
+    SDL_Log("Save state file is truncated: %s\n", path);
+    return false;
+  }
+  return chip8_restore(chip8, &state);
+}
+
+// handles window events and emulator controls, keypad keys are taken care of by input_watch
+static void handle_input(controls_t *controls, uint64_t *dirty_rows) {
+  SDL_Event event = {0};
+  while (SDL_PollEvent(&event)) {
+    switch (event.type) {
+      case SDL_WINDOWEVENT:
+        // the window contents may have been lost, so redraw everything on the next update
+        if (event.window.event == SDL_WINDOWEVENT_EXPOSED)
+          *dirty_rows = UINT64_MAX;
+        break;
+        
+      case SDL_KEYUP:
+        switch (event.key.keysym.sym) {
+          case SDLK_BACKSPACE:
+            atomic_store(&controls->rewinding, false);
+            break;
+            
           default:
             break;
         }
@@ -284,422 +1679,3513 @@ void handle_input(chip8_t *chip8) {
       case SDL_KEYDOWN:
         switch(event.key.keysym.sym) {
           case SDLK_ESCAPE:
-            chip8->state = STOPPED;
+            atomic_store(&controls->quit, true);
             return;
             
           case SDLK_SPACE:
-            if (chip8->state == RUNNING) {
-              chip8->state = PAUSED;
+            if (!atomic_load(&controls->paused)) {
+              atomic_store(&controls->paused, true);
               SDL_Log("=== EMULATION PAUSED ===\n");
             } else {
-              chip8->state = RUNNING;
+              atomic_store(&controls->paused, false);
               SDL_Log("=== EMULATION RESUMED ===\n");
             }
             return;
-  
-          case SDLK_1:
-            chip8->keypad[0x1] = true;
-            break;
-  
-          case SDLK_2:
-            chip8->keypad[0x2] = true;
+            
+          case SDLK_TAB:
+            if (!atomic_load(&controls->turbo)) {
+              atomic_store(&controls->turbo, true);
+              SDL_Log("=== FAST FORWARD ON ===\n");
+            } else {
+              atomic_store(&controls->turbo, false);
+              SDL_Log("=== FAST FORWARD OFF ===\n");
+            }
+            return;
+            
+          case SDLK_F5:
+            atomic_fetch_or(&controls->requests, REQUEST_SAVE_STATE);
+            return;
+            
+          case SDLK_F7:
+            atomic_fetch_or(&controls->requests, REQUEST_LOAD_STATE);
+            return;
+            
+          case SDLK_BACKSPACE:
+            atomic_store(&controls->rewinding, true);
             break;
-  
-          case SDLK_3:
-            chip8->keypad[0x3] = true;
+            
+          case SDLK_PAGEUP:
+            atomic_store(&controls->rom_switch, -1);
+            return;
+            
+          case SDLK_PAGEDOWN:
+            atomic_store(&controls->rom_switch, 1);
+            return;
+            
+          case SDLK_F9:
+            atomic_fetch_or(&controls->requests, REQUEST_PROFILE_DUMP);
+            return;
+            
+          default:
             break;
+        }
+        break;
+        
+      default:
+        break;
+    }
+  }
+}
+#endif
+
+// counts one executed instruction, every engine calls this just before running it
+static inline void profile_op(profile_t *profile, const uint16_t address, const uint16_t opcode) {
+  profile->instructions++;
+  profile->opcode_hits[opcode]++;
+  profile->pc_hits[address]++;
+}
+
+// copies a record into the ring, waiting for the writer thread if there isn't room
+static void trace_push(trace_t *trace, const uint8_t *bytes, const size_t count) {
+  const size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+  if (TRACE_RING_SIZE - (head - atomic_load_explicit(&trace->tail, memory_order_acquire)) < count) {
+    trace->stalls++;
+    while (TRACE_RING_SIZE - (head - atomic_load_explicit(&trace->tail, memory_order_acquire)) < count)
+      SDL_Delay(0);
+  }
   
-          case SDLK_4:
-            chip8->keypad[0xC] = true;
-            break;
+  for (size_t i = 0; i < count; i++)
+    trace->ring[(head + i) & (TRACE_RING_SIZE - 1)] = bytes[i];
+  atomic_store_explicit(&trace->head, head + count, memory_order_release);
+}
+
+// emits the pending record now that V after it is known
+static void trace_flush(trace_t *trace, const uint8_t V[16]) {
+  if (!trace->pending) return;
+  trace->pending = false;
   
-          case SDLK_q:
-            chip8->keypad[0x4] = true;
-            break;
+  uint8_t record[1 + 2 + 4 + 2 + 16];
+  size_t length = 0;
+  record[length++] = trace->pending_kind;
+  record[length++] = trace->pending_pc & 0xFF;
+  record[length++] = trace->pending_pc >> 8;
+  for (uint32_t i = 0; i < (trace->pending_kind == TRACE_OP ? 2u : 4u); i++)
+    record[length++] = trace->pending_arg >> (8 * i) & 0xFF;
   
-          case SDLK_w:
-            chip8->keypad[0x5] = true;
-            break;
+  uint16_t changed = 0;
+  for (int i = 0; i <= 0xF; i++)
+    changed |= (V[i] != trace->last_V[i]) << i;
+  record[length++] = changed & 0xFF;
+  record[length++] = changed >> 8;
+  for (int i = 0; i <= 0xF; i++) {
+    if (changed >> i & 1)
+      record[length++] = V[i];
+  }
   
-          case SDLK_e:
-            chip8->keypad[0x6] = true;
-            break;
+  trace_push(trace, record, length);
+}
+
+static void trace_begin(trace_t *trace, const trace_kind_t kind, const uint16_t pc, const uint32_t arg, const uint8_t V[16]) {
+  trace_flush(trace, V);
+  trace->pending = true;
+  trace->pending_kind = kind;
+  trace->pending_pc = pc;
+  trace->pending_arg = arg;
+  memcpy(trace->last_V, V, sizeof trace->last_V);
+}
+
+// called by every engine just before running an instruction
+static inline void trace_op(trace_t *trace, const uint16_t pc, const uint16_t opcode, const uint8_t V[16]) {
+  trace_begin(trace, TRACE_OP, pc, opcode, V);
+}
+
+static void trace_frame(trace_t *trace, const uint8_t V[16], const uint8_t delay_timer, const uint8_t sound_timer) {
+  trace_flush(trace, V);
+  const uint8_t record[3] = {TRACE_FRAME, delay_timer, sound_timer};
+  trace_push(trace, record, sizeof record);
+}
+
+#ifndef CHIP8_LIBRARY
+static int trace_writer(void *data) {
+  trace_t *trace = data;
   
-          case SDLK_r:
-            chip8->keypad[0xD] = true;
-            break;
+  for (;;) {
+    // stop is read before head, so everything produced before stopping still gets written
+    const bool stopping = atomic_load_explicit(&trace->stop, memory_order_acquire);
+    const size_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+    const size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    if (head == tail) {
+      if (stopping) return 0;
+      SDL_Delay(1);
+      continue;
+    }
+    
+    const size_t start = tail & (TRACE_RING_SIZE - 1);
+    const size_t count = head - tail < TRACE_RING_SIZE - start ? head - tail : TRACE_RING_SIZE - start;
+    fwrite(&trace->ring[start], 1, count, trace->file);
+    atomic_store_explicit(&trace->tail, tail + count, memory_order_release);
+  }
+}
+
+static bool trace_init(chip8_t *chip8, const config_t *config) {
+  if (!config->trace_path) return true;
   
-          case SDLK_a:
-            chip8->keypad[0x7] = true;
-            break;
+  trace_t *trace = calloc(1, sizeof(trace_t));
+  if (!trace) {
+    SDL_Log("Unable to allocate trace buffer\n");
+    return false;
+  }
   
-          case SDLK_s:
-            chip8->keypad[0x8] = true;
-            break;
+  const uint32_t header[2] = {TRACE_MAGIC, TRACE_VERSION};
+  trace->file = fopen(config->trace_path, "wb");
+  if (!trace->file || fwrite(header, sizeof header, 1, trace->file) != 1) {
+    SDL_Log("Unable to open trace file: %s\n", config->trace_path);
+    if (trace->file) fclose(trace->file);
+    free(trace);
+    return false;
+  }
   
-          case SDLK_d:
-            chip8->keypad[0x9] = true;
-            break;
+  trace->writer = SDL_CreateThread(trace_writer, "chip8 trace", trace);
+  if (!trace->writer) {
+    SDL_Log("Unable to start trace writer: %s\n", SDL_GetError());
+    fclose(trace->file);
+    free(trace);
+    return false;
+  }
   
-          case SDLK_f:
-            chip8->keypad[0xE] = true;
-            break;
+  chip8->trace = trace;
+  return true;
+}
+
+// writes out the last record and everything still in the ring
+static void trace_finish(chip8_t *chip8) {
+  trace_t *trace = chip8->trace;
+  if (!trace) return;
   
-          case SDLK_z:
-            chip8->keypad[0xA] = true;
-            break;
+  trace_flush(trace, chip8->V);
+  atomic_store_explicit(&trace->stop, true, memory_order_release);
+  SDL_WaitThread(trace->writer, NULL);
   
-          case SDLK_x:
-            chip8->keypad[0x0] = true;
-            break;
+  if (trace->stalls)
+    SDL_Log("Trace writer fell behind %llu times\n", (unsigned long long) trace->stalls);
+  if (fclose(trace->file) != 0)
+    SDL_Log("Failed to write trace file\n");
+  free(trace);
+  chip8->trace = NULL;
+}
+
+// prints a trace file as one line per record
+static bool decode_trace(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    SDL_Log("Unable to open trace file: %s\n", path);
+    return false;
+  }
   
-          case SDLK_c:
-            chip8->keypad[0xB] = true;
-            break;
+  uint32_t header[2];
+  if (fread(header, sizeof header, 1, file) != 1 || header[0] != TRACE_MAGIC || header[1] != TRACE_VERSION) {
+    SDL_Log("Not a trace from this version of the emulator: %s\n", path);
+    fclose(file);
+    return false;
+  }
   
-          case SDLK_v:
-            chip8->keypad[0xF] = true;
-            break;
-            
-          default:
-            break;
-        }
-        
-      default:
-        break;
+  uint64_t frame = 0;
+  uint8_t word[4];
+  int kind;
+  while ((kind = fgetc(file)) != EOF) {
+    if (kind == TRACE_FRAME) {
+      if (fread(word, 2, 1, file) != 1) break;
+      printf("frame %llu DT=%u ST=%u\n", (unsigned long long) ++frame, word[0], word[1]);
+      continue;
+    }
+    
+    if (fread(word, 2, 1, file) != 1) break;
+    const uint16_t pc = word[0] | word[1] << 8;
+    if (kind == TRACE_OP) {
+      if (fread(word, 2, 1, file) != 1) break;
+      printf("0x%04X %04X", pc, word[0] | word[1] << 8);
+    } else {
+      if (fread(word, 4, 1, file) != 1) break;
+      printf("0x%04X idle %u cycles", pc, word[0] | word[1] << 8 | word[2] << 16 | (uint32_t) word[3] << 24);
+    }
+    
+    if (fread(word, 2, 1, file) != 1) break;
+    const uint16_t changed = word[0] | word[1] << 8;
+    for (int i = 0; i <= 0xF; i++) {
+      if (changed >> i & 1) {
+        const int value = fgetc(file);
+        if (value == EOF) break;
+        printf(" V%X=%02X", i, value);
+      }
     }
+    putchar('\n');
   }
+  
+  fclose(file);
+  return true;
 }
-
-void emulate_instruction(chip8_t *chip8, config_t config) {
-  // fetch opcode and pre-increment program counter. opcodes are 16 bits so we need to combine ram[PC] and ram[PC + 1]
-  chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1]; // they're also big endian
-#ifdef DEBUG
-  SDL_Log("Address: 0x%04X   Opcode: 0x%04X\n", chip8->PC, chip8->inst.opcode);
-//  if (chip8->state == RUNNING) chip8->state = PAUSED; // enables single cycle step-through
 #endif
-  chip8->PC += 2;
-  
-  // decode opcode
-  chip8->inst.NNN = chip8->inst.opcode & 0xFFF;
-  chip8->inst.NN = chip8->inst.opcode & 0xFF;
-  chip8->inst.N = chip8->inst.opcode & 0xF;
-  chip8->inst.X = chip8->inst.opcode >> 8 & 0xF;
-  chip8->inst.Y = chip8->inst.opcode >> 4 & 0xF;
-  
-  // execute opcode
-  switch (chip8->inst.opcode >> 12) {
-    case 0x0:
-      switch (chip8->inst.NN) {
-        case 0xE0: // 0x00E0 - clear the screen
-          memset(chip8->display, false, sizeof(chip8->display));  // reset display array to all false
-          break;
-          
-        case 0xEE: // 0x00EE - return from a subroutine
-          chip8->PC = *--chip8->stack_ptr;  // change program counter to last address on stack and decrement stack pointer
-          break;
+
+// Opcode handlers, shared by every execution engine. PC has already been advanced past the instruction.
+// Handlers ending in _q take the quirk bits, those are only called with constants by the per profile
+// variants QUIRK_PROFILES generates below, so their quirk tests are resolved at compile time
+
+// resolution of the current display mode
+static inline uint32_t display_width(const display_t *display) {
+  return display->hires ? DISPLAY_WIDTH : LORES_WIDTH;
+}
+
+static inline uint32_t display_height(const display_t *display) {
+  return display->hires ? DISPLAY_HEIGHT : LORES_HEIGHT;
+}
+
+// distance a taken skip moves PC, over all 4 bytes of an XO-CHIP F000 NNNN with QUIRK_LONG_SKIP
+static inline uint16_t skip_length(const chip8_t *chip8, const uint32_t quirks) {
+  if ((quirks & QUIRK_LONG_SKIP) && chip8->ram[chip8->PC] == 0xF0 && chip8->ram[(chip8->PC + 1) & RAM_MASK] == 0x00)
+    return 4;
+  return 2;
+}
+
+static inline void op_00E0(chip8_t *chip8, const instruction_t *inst) { // 0x00E0 - clear the selected planes
+  (void) inst;
+  for (uint32_t plane = 0; plane < DISPLAY_PLANES; plane++) {
+    if (chip8->planes >> plane & 1)
+      memset(chip8->display.rows[plane], 0, sizeof chip8->display.rows[plane]);  // every row to all pixels off
+  }
+  chip8->dirty_rows = UINT64_MAX;
+}
+
+// moves the selected planes down by rows, or up for a negative count, shifting blank rows in
+static void scroll_vertical(chip8_t *chip8, const int rows) {
+  const uint32_t height = display_height(&chip8->display);
+  const uint32_t count = rows < 0 ? -rows : rows;
   
-        default: // 0x0NNN - jump to NNN
-          chip8->PC = chip8->inst.NNN;
-          break;
-      }
-      break;
-    
-    case 0x1: // 0x1NNN - jump to address NNN
-      chip8->PC = chip8->inst.NNN;
-      break;
+  for (uint32_t plane = 0; plane < DISPLAY_PLANES; plane++) {
+    if (!(chip8->planes >> plane & 1)) continue;
+    uint64_t (*row)[DISPLAY_WORDS] = chip8->display.rows[plane];
+    if (rows > 0) {
+      memmove(&row[count], &row[0], (height - count) * sizeof row[0]);
+      memset(&row[0], 0, count * sizeof row[0]);
+    } else {
+      memmove(&row[0], &row[count], (height - count) * sizeof row[0]);
+      memset(&row[height - count], 0, count * sizeof row[0]);
+    }
+  }
+  chip8->dirty_rows = UINT64_MAX;
+}
+
+static inline void op_00CN(chip8_t *chip8, const instruction_t *inst) { // 0x00CN - scroll down N pixels
+  scroll_vertical(chip8, inst->N);
+}
+
+static inline void op_00DN(chip8_t *chip8, const instruction_t *inst) { // 0x00DN - scroll up N pixels
+  scroll_vertical(chip8, -inst->N);
+}
+
+// horizontal scrolls shift the packed row words, carrying pixels from one word into the next. In lores
+// the second word is always empty, so it shifts nothing into view
+static inline void op_00FB(chip8_t *chip8, const instruction_t *inst) { // 0x00FB - scroll right 4 pixels
+  (void) inst;
+  const uint32_t height = display_height(&chip8->display);
+  for (uint32_t plane = 0; plane < DISPLAY_PLANES; plane++) {
+    if (!(chip8->planes >> plane & 1)) continue;
+    for (uint32_t y = 0; y < height; y++) {
+      uint64_t *row = chip8->display.rows[plane][y];
+      if (chip8->display.hires) row[1] = row[1] >> 4 | row[0] << 60;
+      row[0] >>= 4;
+    }
+  }
+  chip8->dirty_rows = UINT64_MAX;
+}
+
+static inline void op_00FC(chip8_t *chip8, const instruction_t *inst) { // 0x00FC - scroll left 4 pixels
+  (void) inst;
+  const uint32_t height = display_height(&chip8->display);
+  for (uint32_t plane = 0; plane < DISPLAY_PLANES; plane++) {
+    if (!(chip8->planes >> plane & 1)) continue;
+    for (uint32_t y = 0; y < height; y++) {
+      uint64_t *row = chip8->display.rows[plane][y];
+      row[0] = row[0] << 4 | row[1] >> 60;
+      row[1] <<= 4;
+    }
+  }
+  chip8->dirty_rows = UINT64_MAX;
+}
+
+static inline void op_00FD(chip8_t *chip8, const instruction_t *inst) { // 0x00FD - exit, the machine halts here
+  (void) inst;
+  chip8->PC -= 2;
+}
+
+// 0x00FE and 0x00FF - switch to lores or hires, which clears the display
+static inline void set_hires(chip8_t *chip8, const bool hires) {
+  memset(chip8->display.rows, 0, sizeof chip8->display.rows);
+  chip8->display.hires = hires;
+  chip8->dirty_rows = UINT64_MAX;
+}
+
+static inline void op_00FE(chip8_t *chip8, const instruction_t *inst) {
+  (void) inst;
+  set_hires(chip8, false);
+}
+
+static inline void op_00FF(chip8_t *chip8, const instruction_t *inst) {
+  (void) inst;
+  set_hires(chip8, true);
+}
+
+static inline void op_00EE(chip8_t *chip8, const instruction_t *inst) { // 0x00EE - return from a subroutine
+  (void) inst;
+  chip8->PC = chip8->stack[--chip8->stack_top & 0xF];  // decrement stack index and return to the address stored there
+}
+
+static inline void op_1NNN(chip8_t *chip8, const instruction_t *inst) { // 0x1NNN - jump to address NNN (also 0x0NNN)
+  chip8->PC = inst->NNN;
+}
+
+static inline void op_2NNN(chip8_t *chip8, const instruction_t *inst) { // 0x2NNN - call subroutine at NNN
+  chip8->stack[chip8->stack_top++ & 0xF] = chip8->PC;  // push current program counter to stack and increment stack index
+  chip8->PC = inst->NNN;  // change program counter to NNN
+}
+
+static inline void op_3XNN_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0x3XNN - skip next instruction if VX == NN
+  if (chip8->V[inst->X] == inst->NN)
+    chip8->PC += skip_length(chip8, quirks);
+}
+
+static inline void op_4XNN_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0x4XNN - skip next instruction if VX != NN
+  if (chip8->V[inst->X] != inst->NN)
+    chip8->PC += skip_length(chip8, quirks);
+}
+
+static inline void op_5XY0_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0x5XY0 - skip next instruction if VX == VY
+  if (chip8->V[inst->X] == chip8->V[inst->Y])
+    chip8->PC += skip_length(chip8, quirks);
+}
+
+static inline void op_5XY2(chip8_t *chip8, const instruction_t *inst) { // 0x5XY2 - store VX to VY inclusive in memory starting at I, in either order
+  const int step = inst->X <= inst->Y ? 1 : -1;
+  const int count = abs(inst->Y - inst->X) + 1;
+  for (int offset = 0; offset < count; offset++)
+    chip8->ram[(chip8->I + offset) & RAM_MASK] = chip8->V[inst->X + step * offset];
+  invalidate_code(chip8, chip8->I, count);
+}
+
+static inline void op_5XY3(chip8_t *chip8, const instruction_t *inst) { // 0x5XY3 - load VX to VY inclusive from memory starting at I, in either order
+  const int step = inst->X <= inst->Y ? 1 : -1;
+  const int count = abs(inst->Y - inst->X) + 1;
+  for (int offset = 0; offset < count; offset++)
+    chip8->V[inst->X + step * offset] = chip8->ram[(chip8->I + offset) & RAM_MASK];
+}
+
+static inline void op_6XNN(chip8_t *chip8, const instruction_t *inst) { // 0x6XNN - set VX to NN
+  chip8->V[inst->X] = inst->NN;
+}
+
+static inline void op_7XNN(chip8_t *chip8, const instruction_t *inst) { // 0x7XNN - add NN to VX
+  chip8->V[inst->X] += inst->NN;
+}
+
+static inline void op_8XY0(chip8_t *chip8, const instruction_t *inst) { // 0x8XY0 - set VX to VY
+  chip8->V[inst->X] = chip8->V[inst->Y];
+}
+
+static inline void op_8XY1_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0x8XY1 - VX |= VY
+  chip8->V[inst->X] |= chip8->V[inst->Y];
+  if (quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
+}
+
+static inline void op_8XY2_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0x8XY2 - VX &= VY
+  chip8->V[inst->X] &= chip8->V[inst->Y];
+  if (quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
+}
+
+static inline void op_8XY3_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0x8XY3 - VX ^= VY
+  chip8->V[inst->X] ^= chip8->V[inst->Y];
+  if (quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
+}
+
+static inline void op_8XY4(chip8_t *chip8, const instruction_t *inst) { // 0x8XY4 - add VY to VX. VF is set to 1 when there's a carry, and 0 when there isn't
+  if ((uint16_t) (chip8->V[inst->X] + chip8->V[inst->Y]) > 0xFF)
+    chip8->V[0xF] = 1;
+  else
+    chip8->V[0xF] = 0;
+  chip8->V[inst->X] += chip8->V[inst->Y];
+}
+
+static inline void op_8XY5(chip8_t *chip8, const instruction_t *inst) { // 0x8XY5 - subtract VY from VX. VF is set to 0 when there's a borrow, and 1 when there isn't
+  if (chip8->V[inst->Y] > chip8->V[inst->X])
+    chip8->V[0xF] = 0;
+  else
+    chip8->V[0xF] = 1;
+  chip8->V[inst->X] = chip8->V[inst->X] - chip8->V[inst->Y];
+}
+
+static inline void op_8XY6_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0x8XY6 - stores the least significant bit of VX in VF and then shifts VX to the right by 1
+  if (quirks & QUIRK_SHIFT_VY) chip8->V[inst->X] = chip8->V[inst->Y];
+  chip8->V[0xF] = chip8->V[inst->X] & 1;
+  chip8->V[inst->X] >>= 1;
+}
+
+static inline void op_8XY7(chip8_t *chip8, const instruction_t *inst) { // 0x8XY7 - VX = VY - VX. VF is set to 0 when there's a borrow, and 1 when there is not
+  if (chip8->V[inst->X] > chip8->V[inst->Y])
+    chip8->V[0xF] = 0;
+  else
+    chip8->V[0xF] = 1;
+  chip8->V[inst->X] = chip8->V[inst->Y] - chip8->V[inst->X];
+}
+
+static inline void op_8XYE_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0x8XYE - stores the most significant bit of VX in VF and then shifts VX to the left by 1
+  if (quirks & QUIRK_SHIFT_VY) chip8->V[inst->X] = chip8->V[inst->Y];
+  chip8->V[0xF] = chip8->V[inst->X] >> 7;
+  chip8->V[inst->X] <<= 1;
+}
+
+static inline void op_9XY0_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0x9XY0 - skip next instruction if VX != VY
+  if (chip8->V[inst->X] != chip8->V[inst->Y])
+    chip8->PC += skip_length(chip8, quirks);
+}
+
+static inline void op_ANNN(chip8_t *chip8, const instruction_t *inst) { // 0xANNN - set I register to NNN
+  chip8->I = inst->NNN;
+}
+
+static inline void op_BNNN_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0xBNNN - jump to address NNN + V0
+  chip8->PC = inst->NNN + chip8->V[(quirks & QUIRK_JUMP_VX) ? inst->X : 0x0];
+}
+
+static inline void op_CXNN(chip8_t *chip8, const instruction_t *inst) { // 0xCXNN - set VX to NN & <a random int 0-255>
+  chip8->V[inst->X] = inst->NN & (uint8_t) (random_next(&chip8->rng) >> 24);
+}
+
+// DXYN of the original machine: one plane, lores and 8 pixel wide sprites. Most ROMs only ever draw
+// like this, so it skips the general draw's plane and word bookkeeping
+static inline void draw_lores(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) {
+  const uint32_t x = chip8->V[inst->X] % LORES_WIDTH;
+  const uint32_t top = chip8->V[inst->Y] % LORES_HEIGHT;
+  const uint8_t *sprite = &chip8->ram[chip8->I];
+  uint64_t (*display)[DISPLAY_WORDS] = chip8->display.rows[0];
+  uint64_t collided = 0, dirty = 0;
+  
+  for (uint32_t i = 0, y = top; i < inst->N; i++, y++) {
+    if (y >= LORES_HEIGHT) {
+      if (!(quirks & QUIRK_WRAP)) break; // rows past the bottom edge are clipped
+      y -= LORES_HEIGHT;
+    }
     
-    case 0x2: // 0x2NNN - call subroutine at NNN
-      *chip8->stack_ptr++ = chip8->PC;  // push current program counter to stack and increment stack pointer
-      chip8->PC = chip8->inst.NNN;  // change program counter to NNN
-      break;
+    // line the sprite byte up with x, pixels shifted past the right edge fall off the end of the word
+    uint64_t sprite_row = (uint64_t) sprite[i] << 56 >> x;
+    if ((quirks & QUIRK_WRAP) && x > 56) sprite_row |= (uint64_t) sprite[i] << (120 - x); // or wrap to the left
+    if (!sprite_row) continue; // an empty sprite row can't change the display
     
-    case 0x3: // 0x3XNN - skip next instruction if VX == NN
-      if (chip8->V[chip8->inst.X] == chip8->inst.NN)
-        chip8->PC += 2;
-      break;
+    collided |= display[y][0] & sprite_row; // pixel "collision" means set carry flag
+    display[y][0] ^= sprite_row; // "collisions" unset the pixels
+    dirty |= 1ull << y;
+  }
+  chip8->dirty_rows |= dirty;
+  chip8->V[0xF] = collided != 0;
+}
+
+static inline void op_DXYN_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0xDXYN - draw N rows starting at (VX, VY) from memory location I, DXY0 draws 16x16
+  if (!chip8->display.hires && chip8->planes == 1 && inst->N) {
+    draw_lores(chip8, inst, quirks);
+    return;
+  }
+  
+  const uint32_t width = display_width(&chip8->display);
+  const uint32_t height = display_height(&chip8->display);
+  const uint32_t words = width / 64;
+  const uint32_t x = chip8->V[inst->X] & (width - 1);
+  const uint32_t word = x / 64, shift = x % 64;
+  const uint32_t top = chip8->V[inst->Y] & (height - 1);
+  const uint32_t rows = inst->N ? inst->N : 16;
+  const uint32_t row_bytes = inst->N ? 1 : 2;
+  // rows past the bottom edge are clipped unless they wrap around to the top
+  const uint32_t drawn = (quirks & QUIRK_WRAP) || top + rows <= height ? rows : height - top;
+  const uint8_t *sprite = &chip8->ram[chip8->I];
+  uint64_t collided = 0, dirty = 0;
+  
+  // each selected plane draws the next rows * row_bytes bytes from I
+  for (uint32_t plane = 0; plane < DISPLAY_PLANES; plane++, sprite += rows * row_bytes) {
+    if (!(chip8->planes >> plane & 1)) continue;
+    uint64_t (*display)[DISPLAY_WORDS] = chip8->display.rows[plane];
     
-    case 0x4: // 0x4XNN - skip next instruction if VX != NN
-      if (chip8->V[chip8->inst.X] != chip8->inst.NN)
-        chip8->PC += 2;
+    for (uint32_t i = 0; i < drawn; i++) {
+      const uint32_t y = top + i < height ? top + i : top + i - height;
+      
+      // line the sprite row up with x, pixels shifted past the end of a word carry into the next one
+      const uint64_t bits = row_bytes == 1 ? (uint64_t) sprite[i] << 56
+                                           : (uint64_t) (sprite[2 * i] << 8 | sprite[2 * i + 1]) << 48;
+      if (!bits) continue; // an empty sprite row can't change the display
+      
+      uint64_t *row = display[y];
+      const uint64_t head = bits >> shift;
+      collided |= row[word] & head; // pixel "collision" means set carry flag
+      row[word] ^= head; // "collisions" unset the pixels
+      
+      // past the right edge of the display the carry wraps around or falls off
+      const uint64_t carry = shift ? bits << (64 - shift) : 0;
+      if (carry && (word + 1 < words || (quirks & QUIRK_WRAP))) {
+        uint64_t *next = &row[word + 1 < words ? word + 1 : 0];
+        collided |= *next & carry;
+        *next ^= carry;
+      }
+      dirty |= 1ull << y;
+    }
+  }
+  chip8->dirty_rows |= dirty;
+  chip8->V[0xF] = collided != 0;
+}
+
+static inline void op_EX9E_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0xEX9E - skip next instruction if key in VX is pressed
+  if (chip8->keypad >> (chip8->V[inst->X] & 0xF) & 1)
+    chip8->PC += skip_length(chip8, quirks);
+}
+
+static inline void op_EXA1_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0xEXA1 - skip next instruction if key in VX is not pressed
+  if (!(chip8->keypad >> (chip8->V[inst->X] & 0xF) & 1))
+    chip8->PC += skip_length(chip8, quirks);
+}
+
+static inline void op_FX07(chip8_t *chip8, const instruction_t *inst) { // 0xFX07 - set VX to the value of the delay timer
+  chip8->V[inst->X] = chip8->delay_timer;
+}
+
+static inline void op_FX0A(chip8_t *chip8, const instruction_t *inst) { // 0xFX0A - await a key press, then store it in VX
+  // the lowest numbered key wins when several are down
+  if (chip8->keypad) {
+    chip8->V[inst->X] = __builtin_ctz(chip8->keypad);
+    return;
+  }
+  
+  // this is a way to continuously run this instruction while still allowing the timers to decrement properly
+  chip8->PC -= 2;
+}
+
+static inline void op_FX15(chip8_t *chip8, const instruction_t *inst) { // 0xFX15 - set delay timer to VX
+  chip8->delay_timer = chip8->V[inst->X];
+}
+
+static inline void op_FX18(chip8_t *chip8, const instruction_t *inst) { // 0xFX18 - set sound timer to VX
+  chip8->sound_timer = chip8->V[inst->X];
+}
+
+static inline void op_FX1E(chip8_t *chip8, const instruction_t *inst) { // 0xFX1E - add VX to I
+  chip8->I += chip8->V[inst->X];
+}
+
+static inline void op_FX29(chip8_t *chip8, const instruction_t *inst) { // 0xFX29 - set I to the memory location of the sprite in VX
+  chip8->I = 5 * (chip8->V[inst->X] & 0xF);
+}
+
+static inline void op_FX30(chip8_t *chip8, const instruction_t *inst) { // 0xFX30 - set I to the big SUPER-CHIP sprite of the digit in VX
+  chip8->I = BIG_FONT + 10 * (chip8->V[inst->X] & 0xF);
+}
+
+static inline void op_FX33(chip8_t *chip8, const instruction_t *inst) { // 0xFX33 - store hundreds/tens/ones place of binary coded decimal value of VX in memory at I/I+1/I+2
+  uint8_t value = chip8->V[inst->X];
+  uint8_t ones, tens, hundreds;
+  ones = value % 10;
+  value /= 10;
+  tens = value % 10;
+  hundreds = value / 10;
+  chip8->ram[chip8->I] = hundreds;
+  chip8->ram[(chip8->I + 1) & RAM_MASK] = tens;
+  chip8->ram[(chip8->I + 2) & RAM_MASK] = ones;
+  invalidate_code(chip8, chip8->I, 3);
+}
+
+static inline void op_FX55_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0xFX55 - store from V0 to VX inclusive in memory starting at I
+  for (int offset = 0; offset <= inst->X; offset++)
+    chip8->ram[(chip8->I + offset) & RAM_MASK] = chip8->V[offset];
+  invalidate_code(chip8, chip8->I, inst->X + 1);
+  if (quirks & QUIRK_MEMORY_I) chip8->I += inst->X + 1;
+  if (quirks & QUIRK_MEMORY_IX) chip8->I += inst->X;
+}
+
+static inline void op_FX65_q(chip8_t *chip8, const instruction_t *inst, const uint32_t quirks) { // 0xFX65 - load from V0 to VX inclusive from memory starting at I
+  for (int offset = 0; offset <= inst->X; offset++)
+    chip8->V[offset] = chip8->ram[(chip8->I + offset) & RAM_MASK];
+  if (quirks & QUIRK_MEMORY_I) chip8->I += inst->X + 1;
+  if (quirks & QUIRK_MEMORY_IX) chip8->I += inst->X;
+}
+
+static inline void op_FX3A(chip8_t *chip8, const instruction_t *inst) { // 0xFX3A - set the audio pattern pitch to VX
+  chip8->pitch = chip8->V[inst->X];
+}
+
+static inline void op_FX75(chip8_t *chip8, const instruction_t *inst) { // 0xFX75 - store V0 to VX inclusive in the RPL flags
+  memcpy(chip8->rpl, chip8->V, inst->X + 1);
+}
+
+static inline void op_FX85(chip8_t *chip8, const instruction_t *inst) { // 0xFX85 - load V0 to VX inclusive from the RPL flags
+  memcpy(chip8->V, chip8->rpl, inst->X + 1);
+}
+
+static inline void op_F000(chip8_t *chip8, const instruction_t *inst) { // 0xF000 NNNN - set I to the 16 bit address in the next word
+  (void) inst;
+  chip8->I = chip8->ram[chip8->PC] << 8 | chip8->ram[(chip8->PC + 1) & RAM_MASK];
+  chip8->PC += 2;
+}
+
+static inline void op_FN01(chip8_t *chip8, const instruction_t *inst) { // 0xFN01 - select the planes N that drawing, clearing and scrolling affect
+  chip8->planes = inst->X & ((1 << DISPLAY_PLANES) - 1);
+}
+
+static inline void op_F002(chip8_t *chip8, const instruction_t *inst) { // 0xF002 - load the 16 byte audio pattern from I
+  (void) inst;
+  for (uint32_t i = 0; i < sizeof chip8->audio_pattern; i++)
+    chip8->audio_pattern[i] = chip8->ram[(chip8->I + i) & RAM_MASK];
+}
+
+static inline void op_nop(chip8_t *chip8, const instruction_t *inst) { // unknown opcodes do nothing
+  (void) chip8;
+  (void) inst;
+}
+
+// splits an opcode into its operand fields
+static instruction_t decode_instruction(const uint16_t opcode) {
+  return (instruction_t) {
+    .opcode = opcode,
+    .NNN = opcode & 0xFFF,
+    .NN = opcode & 0xFF,
+    .N = opcode & 0xF,
+    .X = opcode >> 8 & 0xF,
+    .Y = opcode >> 4 & 0xF
+  };
+}
+
+// runs one instruction with the given quirk bits, always inlined into callers that pass a constant
+static inline __attribute__((always_inline)) void emulate_instruction_q(chip8_t *chip8, const uint32_t quirks) {
+  // fetch opcode and pre-increment program counter. opcodes are 16 bits so we need to combine ram[PC] and ram[PC + 1]
+  const uint16_t opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[(chip8->PC + 1) & RAM_MASK]; // they're also big endian
+  if (chip8->profile) profile_op(chip8->profile, chip8->PC, opcode);
+  if (chip8->trace) trace_op(chip8->trace, chip8->PC, opcode, chip8->V);
+  chip8->PC += 2;
+  
+  // decode opcode
+  chip8->inst = decode_instruction(opcode);
+  const instruction_t *inst = &chip8->inst;
+  
+  // execute opcode
+  switch (inst->opcode >> 12) {
+    case 0x0:
+      switch (inst->NN) {
+        case 0xE0: op_00E0(chip8, inst); break;
+        case 0xEE: op_00EE(chip8, inst); break;
+        case 0xFB: op_00FB(chip8, inst); break;
+        case 0xFC: op_00FC(chip8, inst); break;
+        case 0xFD: op_00FD(chip8, inst); break;
+        case 0xFE: op_00FE(chip8, inst); break;
+        case 0xFF: op_00FF(chip8, inst); break;
+        default:
+          if ((inst->NN & 0xF0) == 0xC0) op_00CN(chip8, inst);
+          else if ((inst->NN & 0xF0) == 0xD0) op_00DN(chip8, inst);
+          else op_1NNN(chip8, inst); // 0x0NNN - jump to NNN
+          break;
+      }
       break;
     
-    case 0x5: // 0x5XY0 - skip next instruction if VX == VY
-      if (chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y])
-        chip8->PC += 2;
+    case 0x1: op_1NNN(chip8, inst); break;
+    case 0x2: op_2NNN(chip8, inst); break;
+    case 0x3: op_3XNN_q(chip8, inst, quirks); break;
+    case 0x4: op_4XNN_q(chip8, inst, quirks); break;
+    case 0x5:
+      switch (inst->N) {
+        case 0x2: op_5XY2(chip8, inst); break;
+        case 0x3: op_5XY3(chip8, inst); break;
+        default: op_5XY0_q(chip8, inst, quirks); break;
+      }
       break;
+    case 0x6: op_6XNN(chip8, inst); break;
+    case 0x7: op_7XNN(chip8, inst); break;
     
-    case 0x6: // 0x6XNN - set VX to NN
-      chip8->V[chip8->inst.X] = chip8->inst.NN;
+    case 0x8:
+      switch (inst->N) {
+        case 0x0: op_8XY0(chip8, inst); break;
+        case 0x1: op_8XY1_q(chip8, inst, quirks); break;
+        case 0x2: op_8XY2_q(chip8, inst, quirks); break;
+        case 0x3: op_8XY3_q(chip8, inst, quirks); break;
+        case 0x4: op_8XY4(chip8, inst); break;
+        case 0x5: op_8XY5(chip8, inst); break;
+        case 0x6: op_8XY6_q(chip8, inst, quirks); break;
+        case 0x7: op_8XY7(chip8, inst); break;
+        case 0xE: op_8XYE_q(chip8, inst, quirks); break;
+        default: break;
+      }
       break;
     
-    case 0x7: // 0x7XNN - add NN to VX
-      chip8->V[chip8->inst.X] += chip8->inst.NN;
-      break;
+    case 0x9: op_9XY0_q(chip8, inst, quirks); break;
+    case 0xA: op_ANNN(chip8, inst); break;
+    case 0xB: op_BNNN_q(chip8, inst, quirks); break;
+    case 0xC: op_CXNN(chip8, inst); break;
+    case 0xD: op_DXYN_q(chip8, inst, quirks); break;
     
-    case 0x8:
-      switch (chip8->inst.N) {
-        case 0x0: // 0x8XY0 - set VX to VY
-          chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
-          break;
-          
-        case 0x1: // 0x8XY1 - VX |= VY
-          chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
-          break;
-  
-        case 0x2: // 0x8XY2 - VX &= VY
-          chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
-          break;
-  
-        case 0x3: // 0x8XY3 - VX ^= VY
-          chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
-          break;
-          
-        case 0x4: // 0x8XY4 - add VY to VX. VF is set to 1 when there's a carry, and 0 when there isn't
-          if ((uint16_t) (chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 0xFF)
-            chip8->V[0xF] = 1;
-          else
-            chip8->V[0xF] = 0;
-          chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
-          break;
-        
-        case 0x5: // 0x8XY5 - subtract VY from VX. VF is set to 0 when there's a borrow, and 1 when there isn't
-          if (chip8->V[chip8->inst.Y] > chip8->V[chip8->inst.X])
-            chip8->V[0xF] = 0;
-          else
-            chip8->V[0xF] = 1;
-          chip8->V[chip8->inst.X] = chip8->V[chip8->inst.X] - chip8->V[chip8->inst.Y];
-          break;
-          
-        case 0x6: // 0x8XY6 - stores the least significant bit of VX in VF and then shifts VX to the right by 1
-          chip8->V[0xF] = chip8->V[chip8->inst.X] & 1;
-          chip8->V[chip8->inst.X] >>= 1;
-          break;
-        
-        case 0x7: // 0x8XY7 - VX = VY - VX. VF is set to 0 when there's a borrow, and 1 when there is not
-          if (chip8->V[chip8->inst.X] > chip8->V[chip8->inst.Y])
-            chip8->V[0xF] = 0;
-          else
-            chip8->V[0xF] = 1;
-          chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
-          break;
-        
-        case 0xE: // 0x8XYE - stores the most significant bit of VX in VF and then shifts VX to the left by 1
-          chip8->V[0xF] = chip8->V[chip8->inst.X] >> 7;
-          chip8->V[chip8->inst.X] <<= 1;
-          break;
-          
-        default:
-          break;
+    case 0xE:
+      switch (inst->NN) {
+        case 0x9E: op_EX9E_q(chip8, inst, quirks); break;
+        case 0xA1: op_EXA1_q(chip8, inst, quirks); break;
+        default: break;
       }
       break;
     
-    case 0x9: // 0x9XY0 - skip next instruction if VX != VY
-      if (chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y])
-        chip8->PC += 2;
+    case 0xF:
+      switch (inst->NN) {
+        case 0x00: if (!inst->X) op_F000(chip8, inst); break;
+        case 0x01: op_FN01(chip8, inst); break;
+        case 0x02: op_F002(chip8, inst); break;
+        case 0x07: op_FX07(chip8, inst); break;
+        case 0x0A: op_FX0A(chip8, inst); break;
+        case 0x15: op_FX15(chip8, inst); break;
+        case 0x18: op_FX18(chip8, inst); break;
+        case 0x1E: op_FX1E(chip8, inst); break;
+        case 0x29: op_FX29(chip8, inst); break;
+        case 0x30: op_FX30(chip8, inst); break;
+        case 0x33: op_FX33(chip8, inst); break;
+        case 0x3A: op_FX3A(chip8, inst); break;
+        case 0x55: op_FX55_q(chip8, inst, quirks); break;
+        case 0x65: op_FX65_q(chip8, inst, quirks); break;
+        case 0x75: op_FX75(chip8, inst); break;
+        case 0x85: op_FX85(chip8, inst); break;
+        default: break;
+      }
       break;
     
-    case 0xA: // 0xANNN - set I register to NNN
-      chip8->I = chip8->inst.NNN;
+    default:
       break;
+  }
+}
+
+// handler variants of each quirk profile for the opcodes quirks change, op_8XY6_vip and so on
+#define QUIRK_PROFILE_HANDLERS(id, name, suffix, bits) \
+  static inline void op_3XNN##suffix(chip8_t *chip8, const instruction_t *inst) { op_3XNN_q(chip8, inst, bits); } \
+  static inline void op_4XNN##suffix(chip8_t *chip8, const instruction_t *inst) { op_4XNN_q(chip8, inst, bits); } \
+  static inline void op_5XY0##suffix(chip8_t *chip8, const instruction_t *inst) { op_5XY0_q(chip8, inst, bits); } \
+  static inline void op_8XY1##suffix(chip8_t *chip8, const instruction_t *inst) { op_8XY1_q(chip8, inst, bits); } \
+  static inline void op_8XY2##suffix(chip8_t *chip8, const instruction_t *inst) { op_8XY2_q(chip8, inst, bits); } \
+  static inline void op_8XY3##suffix(chip8_t *chip8, const instruction_t *inst) { op_8XY3_q(chip8, inst, bits); } \
+  static inline void op_8XY6##suffix(chip8_t *chip8, const instruction_t *inst) { op_8XY6_q(chip8, inst, bits); } \
+  static inline void op_8XYE##suffix(chip8_t *chip8, const instruction_t *inst) { op_8XYE_q(chip8, inst, bits); } \
+  static inline void op_9XY0##suffix(chip8_t *chip8, const instruction_t *inst) { op_9XY0_q(chip8, inst, bits); } \
+  static inline void op_BNNN##suffix(chip8_t *chip8, const instruction_t *inst) { op_BNNN_q(chip8, inst, bits); } \
+  static inline void op_DXYN##suffix(chip8_t *chip8, const instruction_t *inst) { op_DXYN_q(chip8, inst, bits); } \
+  static inline void op_EX9E##suffix(chip8_t *chip8, const instruction_t *inst) { op_EX9E_q(chip8, inst, bits); } \
+  static inline void op_EXA1##suffix(chip8_t *chip8, const instruction_t *inst) { op_EXA1_q(chip8, inst, bits); } \
+  static inline void op_FX55##suffix(chip8_t *chip8, const instruction_t *inst) { op_FX55_q(chip8, inst, bits); } \
+  static inline void op_FX65##suffix(chip8_t *chip8, const instruction_t *inst) { op_FX65_q(chip8, inst, bits); }
+QUIRK_PROFILES(QUIRK_PROFILE_HANDLERS)
+#undef QUIRK_PROFILE_HANDLERS
+
+// quirk bits and handler variants of every profile, by quirk_profile_t
+typedef struct {
+  uint32_t bits;
+  op_handler_t op_3XNN, op_4XNN, op_5XY0, op_8XY1, op_8XY2, op_8XY3, op_8XY6, op_8XYE, op_9XY0, op_BNNN, op_DXYN,
+               op_EX9E, op_EXA1, op_FX55, op_FX65;
+} quirk_handlers_t;
+
+static const quirk_handlers_t quirk_handlers[] = {
+#define QUIRK_PROFILE_TABLE(id, name, suffix, bits) \
+  [id] = {bits, op_3XNN##suffix, op_4XNN##suffix, op_5XY0##suffix, op_8XY1##suffix, op_8XY2##suffix, \
+          op_8XY3##suffix, op_8XY6##suffix, op_8XYE##suffix, op_9XY0##suffix, op_BNNN##suffix, op_DXYN##suffix, \
+          op_EX9E##suffix, op_EXA1##suffix, op_FX55##suffix, op_FX65##suffix},
+  QUIRK_PROFILES(QUIRK_PROFILE_TABLE)
+#undef QUIRK_PROFILE_TABLE
+};
+
+// picks the handler for an opcode, mirrors the dispatch in emulate_instruction. Where the profile's quirks
+// don't change an opcode the default handler is used, so the JIT and batch engines can still recognize it
+static op_handler_t decode_handler(const instruction_t *inst, const quirk_profile_t profile) {
+  const quirk_handlers_t *variants = &quirk_handlers[profile];
+  switch (inst->opcode >> 12) {
+    case 0x0:
+      switch (inst->NN) {
+        case 0xE0: return op_00E0;
+        case 0xEE: return op_00EE;
+        case 0xFB: return op_00FB;
+        case 0xFC: return op_00FC;
+        case 0xFD: return op_00FD;
+        case 0xFE: return op_00FE;
+        case 0xFF: return op_00FF;
+        default:
+          if ((inst->NN & 0xF0) == 0xC0) return op_00CN;
+          if ((inst->NN & 0xF0) == 0xD0) return op_00DN;
+          return op_1NNN;
+      }
+    case 0x1: return op_1NNN;
+    case 0x2: return op_2NNN;
+    case 0x3: return (variants->bits & QUIRK_LONG_SKIP) ? variants->op_3XNN : op_3XNN;
+    case 0x4: return (variants->bits & QUIRK_LONG_SKIP) ? variants->op_4XNN : op_4XNN;
+    case 0x5:
+      switch (inst->N) {
+        case 0x2: return op_5XY2;
+        case 0x3: return op_5XY3;
+        default: return (variants->bits & QUIRK_LONG_SKIP) ? variants->op_5XY0 : op_5XY0;
+      }
+    case 0x6: return op_6XNN;
+    case 0x7: return op_7XNN;
+    case 0x8:
+      switch (inst->N) {
+        case 0x0: return op_8XY0;
+        case 0x1: return (variants->bits & QUIRK_VF_RESET) ? variants->op_8XY1 : op_8XY1;
+        case 0x2: return (variants->bits & QUIRK_VF_RESET) ? variants->op_8XY2 : op_8XY2;
+        case 0x3: return (variants->bits & QUIRK_VF_RESET) ? variants->op_8XY3 : op_8XY3;
+        case 0x4: return op_8XY4;
+        case 0x5: return op_8XY5;
+        case 0x6: return (variants->bits & QUIRK_SHIFT_VY) ? variants->op_8XY6 : op_8XY6;
+        case 0x7: return op_8XY7;
+        case 0xE: return (variants->bits & QUIRK_SHIFT_VY) ? variants->op_8XYE : op_8XYE;
+        default: return op_nop;
+      }
+    case 0x9: return (variants->bits & QUIRK_LONG_SKIP) ? variants->op_9XY0 : op_9XY0;
+    case 0xA: return op_ANNN;
+    case 0xB: return (variants->bits & QUIRK_JUMP_VX) ? variants->op_BNNN : op_BNNN;
+    case 0xC: return op_CXNN;
+    case 0xD: return (variants->bits & QUIRK_WRAP) ? variants->op_DXYN : op_DXYN;
+    case 0xE:
+      switch (inst->NN) {
+        case 0x9E: return (variants->bits & QUIRK_LONG_SKIP) ? variants->op_EX9E : op_EX9E;
+        case 0xA1: return (variants->bits & QUIRK_LONG_SKIP) ? variants->op_EXA1 : op_EXA1;
+        default: return op_nop;
+      }
+    case 0xF:
+      switch (inst->NN) {
+        case 0x00: return inst->X ? op_nop : op_F000;
+        case 0x01: return op_FN01;
+        case 0x02: return op_F002;
+        case 0x07: return op_FX07;
+        case 0x0A: return op_FX0A;
+        case 0x15: return op_FX15;
+        case 0x18: return op_FX18;
+        case 0x1E: return op_FX1E;
+        case 0x29: return op_FX29;
+        case 0x30: return op_FX30;
+        case 0x33: return op_FX33;
+        case 0x3A: return op_FX3A;
+        case 0x55: return (variants->bits & (QUIRK_MEMORY_I | QUIRK_MEMORY_IX)) ? variants->op_FX55 : op_FX55;
+        case 0x65: return (variants->bits & (QUIRK_MEMORY_I | QUIRK_MEMORY_IX)) ? variants->op_FX65 : op_FX65;
+        case 0x75: return op_FX75;
+        case 0x85: return op_FX85;
+        default: return op_nop;
+      }
+    default:
+      return op_nop;
+  }
+}
+
+// runs one instruction with the machine's quirk profile. The engines' hot loops call their profile's
+// variant directly, this is for the odd instruction they can't run themselves
+static void emulate_instruction(chip8_t *chip8) {
+  switch (chip8->quirk_profile) {
+#define QUIRK_PROFILE_CASE(id, name, suffix, bits) case id: emulate_instruction_q(chip8, bits); break;
+    QUIRK_PROFILES(QUIRK_PROFILE_CASE)
+#undef QUIRK_PROFILE_CASE
+  }
+}
+
+// same as emulate_instruction but looks the instruction up in the decode cache, decoding only on a miss
+static void emulate_instruction_cached(chip8_t *chip8) {
+  const uint16_t address = chip8->PC;
+  decoded_t *entry = &chip8->decode_cache[address];
+  
+  if (!entry->handler) {
+    entry->inst = decode_instruction((chip8->ram[address] << 8) | chip8->ram[(address + 1) & RAM_MASK]);
+    entry->handler = decode_handler(&entry->inst, chip8->quirk_profile);
+  }
+  if (chip8->profile) profile_op(chip8->profile, address, entry->inst.opcode);
+  if (chip8->trace) trace_op(chip8->trace, address, entry->inst.opcode, chip8->V);
+  chip8->PC += 2;
+  
+  // handlers only ever clear entry->handler on invalidation so the operands stay valid during the call
+  entry->handler(chip8, &entry->inst);
+}
+
+// instructions that leave straight-line code or may rewrite it, so a block has to end after them. Skips,
+// BNNN and FX55 have quirk variants, so those are told by opcode
+static bool ends_block(const decoded_t *op) {
+  const op_handler_t handler = op->handler;
+  const uint16_t opcode = op->inst.opcode;
+  switch (opcode >> 12) {
+    case 0x0: return handler == op_1NNN || handler == op_00EE || handler == op_00FD;
+    case 0x1: case 0x2: case 0x3: case 0x4: case 0x9: case 0xB: return true;
+    case 0x5: return handler != op_5XY3; // 5XY2 stores
+    case 0xE: return handler != op_nop;
+    case 0xF: return handler == op_FX0A || handler == op_FX33 || handler == op_F000 || (opcode & 0xF0FF) == 0xF055;
+    default: return false;
+  }
+}
+
+// decodes the straight-line run of instructions starting at address into a block
+static void translate_block(block_cache_t *cache, const uint8_t *ram, const uint16_t address, const quirk_profile_t profile,
+                     block_t *block) {
+  uint32_t a = address;
+  block->length = 0;
+  
+  while (block->length < MAX_BLOCK_LENGTH) {
+    decoded_t *op = &block->ops[block->length++];
+    op->inst = decode_instruction((ram[a] << 8) | ram[(a + 1) & RAM_MASK]);
+    op->handler = decode_handler(&op->inst, profile);
+    cache->code[a] = true;
+    cache->code[(a + 1) & RAM_MASK] = true;
     
-    case 0xB: // 0xBNNN - jump to address NNN + V0
-      chip8->PC = chip8->inst.NNN + chip8->V[0x0];
-      break;
+    a += 2;
+    if (ends_block(op) || a >= RAM_SIZE) break;
+  }
+}
+
+// returns the translated block starting at address, or NULL if it couldn't be allocated
+static block_t *lookup_block(chip8_t *chip8, const uint16_t address) {
+  block_cache_t *cache = chip8->block_cache;
+  block_t *block = cache->blocks[address];
+  
+  if (!block) {
+    block = cache->blocks[address] = malloc(sizeof(block_t));
+    if (!block) return NULL;
+    block->length = 0;
+  }
+  if (!block->length) {
+    translate_block(cache, chip8->ram, address, chip8->quirk_profile, block);
+    block->native = NULL;
+  }
+  
+  return block;
+}
+
+// runs the first length instructions of a block through their handlers
+static void interpret_block(chip8_t *chip8, const block_t *block, const uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    if (chip8->profile) profile_op(chip8->profile, chip8->PC, block->ops[i].inst.opcode);
+    if (chip8->trace) trace_op(chip8->trace, chip8->PC, block->ops[i].inst.opcode, chip8->V);
+    chip8->PC += 2;
+    block->ops[i].handler(chip8, &block->ops[i].inst);
+  }
+}
+
+// runs the block at PC, or just its first budget instructions, and returns how many were executed
+static uint32_t emulate_block(chip8_t *chip8, const uint32_t budget) {
+  const block_t *block = lookup_block(chip8, chip8->PC);
+  if (!block) {
+    // out of memory, fall back to a plain interpreted step
+    emulate_instruction(chip8);
+    return 1;
+  }
+  
+  // a store at the end of the block can invalidate it, so the length is read once up front
+  const uint32_t length = block->length < budget ? block->length : budget;
+  interpret_block(chip8, block, length);
+  return length;
+}
+
+#ifdef JIT_SUPPORTED
+// x86-64 encoding helpers. chip8_t is addressed through rbx, so every memory operand is [rbx + disp32].
+// The V registers a block uses most are kept in r12b-r15b while it runs
+#define CHIP8_V(x) (offsetof(chip8_t, V) + (x))
+#define CHIP8_I offsetof(chip8_t, I)
+#define CHIP8_PC offsetof(chip8_t, PC)
+#define CHIP8_DT offsetof(chip8_t, delay_timer)
+#define CHIP8_ST offsetof(chip8_t, sound_timer)
+
+static void emit_bytes(uint8_t **p, const uint8_t *bytes, const size_t count) {
+  memcpy(*p, bytes, count);
+  *p += count;
+}
+
+static void emit_u16(uint8_t **p, const uint16_t value) {
+  emit_bytes(p, (const uint8_t *) &value, 2);
+}
+
+static void emit_u32(uint8_t **p, const uint32_t value) {
+  emit_bytes(p, (const uint8_t *) &value, 4);
+}
+
+static void emit_u64(uint8_t **p, const uint64_t value) {
+  emit_bytes(p, (const uint8_t *) &value, 8);
+}
+
+// <opcode bytes> with a mod=10 rm=rbx ModRM byte for reg and a 32 bit displacement
+static void emit_rbx_op(uint8_t **p, const uint8_t *opcode, const size_t count, const uint8_t reg, const uint32_t disp) {
+  emit_bytes(p, opcode, count);
+  *(*p)++ = 0x80 | reg << 3 | 0x3;
+  emit_bytes(p, (const uint8_t *) &disp, 4);
+}
+
+#define EMIT(p, ...) emit_bytes(p, (const uint8_t[]) {__VA_ARGS__}, sizeof((const uint8_t[]) {__VA_ARGS__}))
+#define EMIT_RBX(p, reg, disp, ...) emit_rbx_op(p, (const uint8_t[]) {__VA_ARGS__}, sizeof((const uint8_t[]) {__VA_ARGS__}), reg, disp)
+
+#define JIT_HOST_REGS 4  // r12-r15, callee saved so handler calls leave them alone
+
+// V registers a block keeps in host registers
+typedef struct {
+  int8_t host[16];                 // r12 + host[x] holds V[x], -1 while V[x] stays in chip8_t
+  uint8_t cached[JIT_HOST_REGS];   // the V register in each host register in use
+  uint32_t count;
+  uint32_t uses[16];               // V operands emitted so far, a first pass uses these to pick what to cache
+} jit_regs_t;
+
+// <opcode bytes> with V[x] as the r/m operand, either its host register or [rbx + disp32]
+static void emit_v_op(uint8_t **p, jit_regs_t *regs, const uint8_t *opcode, const size_t count, const uint8_t reg,
+                      const uint8_t x) {
+  regs->uses[x]++;
+  if (regs->host[x] < 0) {
+    emit_rbx_op(p, opcode, count, reg, CHIP8_V(x));
+    return;
+  }
+  *(*p)++ = 0x41;                     // REX.B, r/m is r12-r15
+  emit_bytes(p, opcode, count);
+  *(*p)++ = 0xC0 | reg << 3 | (4 + regs->host[x]);
+}
+
+#define EMIT_V(p, regs, reg, x, ...) \
+  emit_v_op(p, regs, (const uint8_t[]) {__VA_ARGS__}, sizeof((const uint8_t[]) {__VA_ARGS__}), reg, x)
+
+// writes the cached V registers back to chip8_t, or reloads them from it, around anything that reads
+// or writes them there: handler calls and the end of the block
+static void emit_v_sync(uint8_t **p, const jit_regs_t *regs, const bool store) {
+  for (uint32_t k = 0; k < regs->count; k++) {
+    *(*p)++ = 0x44;                   // REX.R, reg is r12-r15
+    if (store)
+      EMIT_RBX(p, 4 + k, CHIP8_V(regs->cached[k]), 0x88);       // mov [V], r12b + k
+    else
+      EMIT_RBX(p, 4 + k, CHIP8_V(regs->cached[k]), 0x0F, 0xB6); // movzx r12d + k, byte [V]
+  }
+}
+
+// mov word [rbx + PC], value
+static void emit_set_pc(uint8_t **p, const uint16_t value) {
+  EMIT_RBX(p, 0, CHIP8_PC, 0x66, 0xC7);
+  emit_u16(p, value);
+}
+
+// native code for 8XY4/8XY5/8XY7: flag from the original values first, then the result,
+// reloading both operands so VF as X or Y behaves exactly like the handlers
+static void emit_flag_arith(uint8_t **p, jit_regs_t *regs, const uint8_t dst, const uint8_t lhs, const uint8_t rhs,
+                            const uint8_t flag_op, const uint8_t setcc, const uint8_t result_op) {
+  EMIT_V(p, regs, 0, lhs, 0x8A);        // mov al, [lhs]
+  EMIT_V(p, regs, 0, rhs, flag_op);     // add/cmp al, [rhs]
+  EMIT(p, 0x0F, setcc, 0xC1);           // setc/setae cl
+  EMIT_V(p, regs, 1, 0xF, 0x88);        // mov [VF], cl
+  EMIT_V(p, regs, 0, lhs, 0x8A);        // mov al, [lhs]
+  EMIT_V(p, regs, 0, rhs, result_op);   // add/sub al, [rhs]
+  EMIT_V(p, regs, 0, dst, 0x88);        // mov [dst], al
+}
+
+// native code for a conditional skip: PC = next, then PC = next + 2 unless the jcc over it is taken
+static void emit_skip(uint8_t **p, const uint16_t next, const uint8_t jcc_no_skip) {
+  EMIT(p, jcc_no_skip, 9);              // jcc over the 9 byte PC store below
+  emit_set_pc(p, next + 2);
+}
+
+// emits native code for one instruction if it has a native form, returns false otherwise.
+// V operands are written as [VX] in the comments wherever they live
+static bool emit_native_op(uint8_t **p, jit_regs_t *regs, const decoded_t *op, const uint16_t next) {
+  const instruction_t *inst = &op->inst;
+  const uint8_t x = inst->X;
+  const uint8_t y = inst->Y;
+  
+  if (op->handler == op_6XNN) {
+    EMIT_V(p, regs, 0, x, 0xC6);        // mov byte [VX], NN
+    EMIT(p, inst->NN);
+  } else if (op->handler == op_7XNN) {
+    EMIT_V(p, regs, 0, x, 0x80);        // add byte [VX], NN
+    EMIT(p, inst->NN);
+  } else if (op->handler == op_8XY0) {
+    EMIT_V(p, regs, 0, y, 0x8A);        // mov al, [VY]
+    EMIT_V(p, regs, 0, x, 0x88);        // mov [VX], al
+  } else if (op->handler == op_8XY1 || op->handler == op_8XY2 || op->handler == op_8XY3) {
+    const uint8_t alu = op->handler == op_8XY1 ? 0x08 : op->handler == op_8XY2 ? 0x20 : 0x30;
+    EMIT_V(p, regs, 0, y, 0x8A);        // mov al, [VY]
+    EMIT_V(p, regs, 0, x, alu);         // or/and/xor [VX], al
+  } else if (op->handler == op_8XY4) {
+    emit_flag_arith(p, regs, x, x, y, 0x02, 0x92, 0x02);
+  } else if (op->handler == op_8XY5) {
+    emit_flag_arith(p, regs, x, x, y, 0x3A, 0x93, 0x2A);
+  } else if (op->handler == op_8XY7) {
+    emit_flag_arith(p, regs, x, y, x, 0x3A, 0x93, 0x2A);
+  } else if (op->handler == op_8XY6) {
+    EMIT_V(p, regs, 0, x, 0x8A);        // mov al, [VX]
+    EMIT(p, 0x24, 0x01);                // and al, 1
+    EMIT_V(p, regs, 0, 0xF, 0x88);      // mov [VF], al
+    EMIT_V(p, regs, 5, x, 0xD0);        // shr byte [VX], 1
+  } else if (op->handler == op_8XYE) {
+    EMIT_V(p, regs, 0, x, 0x8A);        // mov al, [VX]
+    EMIT(p, 0xC0, 0xE8, 0x07);          // shr al, 7
+    EMIT_V(p, regs, 0, 0xF, 0x88);      // mov [VF], al
+    EMIT_V(p, regs, 4, x, 0xD0);        // shl byte [VX], 1
+  } else if (op->handler == op_ANNN) {
+    EMIT_RBX(p, 0, CHIP8_I, 0x66, 0xC7); // mov word [I], NNN
+    emit_u16(p, inst->NNN);
+  } else if (op->handler == op_FX1E) {
+    EMIT_V(p, regs, 0, x, 0x0F, 0xB6);  // movzx eax, byte [VX]
+    EMIT_RBX(p, 0, CHIP8_I, 0x66, 0x01); // add [I], ax
+  } else if (op->handler == op_FX29) {
+    EMIT_V(p, regs, 0, x, 0x0F, 0xB6);  // movzx eax, byte [VX]
+    EMIT(p, 0x83, 0xE0, 0x0F);          // and eax, 0xF
+    EMIT(p, 0x8D, 0x04, 0x80);          // lea eax, [rax + rax * 4]
+    EMIT_RBX(p, 0, CHIP8_I, 0x66, 0x89); // mov [I], ax
+  } else if (op->handler == op_FX07) {
+    EMIT_RBX(p, 0, CHIP8_DT, 0x8A);     // mov al, [delay_timer]
+    EMIT_V(p, regs, 0, x, 0x88);        // mov [VX], al
+  } else if (op->handler == op_FX15 || op->handler == op_FX18) {
+    EMIT_V(p, regs, 0, x, 0x8A);        // mov al, [VX]
+    EMIT_RBX(p, 0, op->handler == op_FX15 ? CHIP8_DT : CHIP8_ST, 0x88); // mov [timer], al
+  } else if (op->handler == op_1NNN) {
+    emit_set_pc(p, inst->NNN);
+  } else if (op->handler == op_3XNN || op->handler == op_4XNN) {
+    emit_set_pc(p, next);
+    EMIT_V(p, regs, 7, x, 0x80);        // cmp byte [VX], NN
+    EMIT(p, inst->NN);
+    emit_skip(p, next, op->handler == op_3XNN ? 0x75 : 0x74); // jne/je
+  } else if (op->handler == op_5XY0 || op->handler == op_9XY0) {
+    emit_set_pc(p, next);
+    EMIT_V(p, regs, 0, x, 0x8A);        // mov al, [VX]
+    EMIT_V(p, regs, 0, y, 0x3A);        // cmp al, [VY]
+    emit_skip(p, next, op->handler == op_5XY0 ? 0x75 : 0x74); // jne/je
+  } else {
+    return false;
+  }
+  
+  return true;
+}
+
+// counts a whole block about to run as native code
+static void profile_block(profile_t *profile, const block_t *block, const uint32_t address) {
+  for (uint32_t i = 0; i < block->length; i++)
+    profile_op(profile, address + 2 * i, block->ops[i].inst.opcode);
+}
+
+// worst case is a handler call per instruction with the cached registers spilled and reloaded around it,
+// plus the prologue, profiling call and epilogue
+#define JIT_MAX_BLOCK_SIZE (96 * MAX_BLOCK_LENGTH + 160)
+
+// emits a block's native code at p with regs' V registers cached, returns its end
+static uint8_t *emit_block(uint8_t *p, jit_regs_t *regs, const block_t *block, const uint16_t address,
+                           profile_t *profile) {
+  bool pc_set = false;
+  
+  // rbx and the host registers in use are saved, padded to keep the stack aligned for handler calls
+  EMIT(&p, 0x53);                       // push rbx
+  for (uint32_t k = 0; k < regs->count; k++)
+    EMIT(&p, 0x41, 0x54 + k);           // push r12 + k
+  if (regs->count % 2)
+    EMIT(&p, 0x48, 0x83, 0xEC, 0x08);   // sub rsp, 8
+  EMIT(&p, 0x48, 0x89, 0xFB);           // mov rbx, rdi
+  
+  // profiling counts the block up front, while its length is still the one being compiled
+  if (profile) {
+    EMIT(&p, 0x48, 0xBF);               // mov rdi, profile
+    emit_u64(&p, (uint64_t) (uintptr_t) profile);
+    EMIT(&p, 0x48, 0xBE);               // mov rsi, block
+    emit_u64(&p, (uint64_t) (uintptr_t) block);
+    EMIT(&p, 0xBA);                     // mov edx, address
+    emit_u32(&p, address);
+    EMIT(&p, 0x48, 0xB8);               // mov rax, profile_block
+    emit_u64(&p, (uint64_t) (uintptr_t) profile_block);
+    EMIT(&p, 0xFF, 0xD0);               // call rax
+  }
+  emit_v_sync(&p, regs, false);
+  
+  for (uint32_t i = 0; i < block->length; i++) {
+    const decoded_t *op = &block->ops[i];
+    const uint16_t next = address + 2 * (i + 1);
+    
+    if (emit_native_op(&p, regs, op, next)) {
+      pc_set = op->handler == op_1NNN || op->handler == op_3XNN || op->handler == op_4XNN ||
+               op->handler == op_5XY0 || op->handler == op_9XY0;
+      continue;
+    }
+    
+    // everything else, including DXYN and FX0A, goes through its handler with PC just past the instruction
+    // and the V registers where it expects them
+    emit_v_sync(&p, regs, true);
+    emit_set_pc(&p, next);
+    EMIT(&p, 0x48, 0x89, 0xDF);         // mov rdi, rbx
+    EMIT(&p, 0x48, 0xBE);               // mov rsi, &op->inst
+    emit_u64(&p, (uint64_t) (uintptr_t) &op->inst);
+    EMIT(&p, 0x48, 0xB8);               // mov rax, handler
+    emit_u64(&p, (uint64_t) (uintptr_t) op->handler);
+    EMIT(&p, 0xFF, 0xD0);               // call rax
+    emit_v_sync(&p, regs, false);
+    pc_set = true;
+  }
+  
+  // native ops never touch PC, so a block that ends on one still has to move past itself
+  if (!pc_set)
+    emit_set_pc(&p, address + 2 * block->length);
+  
+  emit_v_sync(&p, regs, true);
+  if (regs->count % 2)
+    EMIT(&p, 0x48, 0x83, 0xC4, 0x08);   // add rsp, 8
+  for (uint32_t k = regs->count; k-- > 0; )
+    EMIT(&p, 0x41, 0x5C + k);           // pop r12 + k
+  EMIT(&p, 0x5B);                       // pop rbx
+  EMIT(&p, 0xC3);                       // ret
+  return p;
+}
+
+// flips the code buffer between writable and executable
+static bool jit_protect(jit_t *jit, const bool executable) {
+  if (jit->executable == executable) return true;
+  if (mprotect(jit->code, jit->size, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) != 0) return false;
+  jit->executable = executable;
+  return true;
+}
+
+// compiles a translated block into native code, or returns NULL when the buffer has to be flushed first.
+// A first pass into a scratch buffer counts how often the block uses each V register, and the second
+// keeps the most used ones that pay for their load and store in host registers
+static native_block_t jit_compile(jit_t *jit, const block_t *block, const uint16_t address, profile_t *profile) {
+  if (jit->size - jit->used < JIT_MAX_BLOCK_SIZE || !jit_protect(jit, false)) return NULL;
+  
+  jit_regs_t regs = {0};
+  memset(regs.host, -1, sizeof regs.host);
+  uint8_t scratch[JIT_MAX_BLOCK_SIZE];
+  emit_block(scratch, &regs, block, address, profile);
+  
+  while (regs.count < JIT_HOST_REGS) {
+    int best = -1;
+    for (int x = 0; x < 16; x++) {
+      if (regs.host[x] < 0 && regs.uses[x] >= 2 && (best < 0 || regs.uses[x] > regs.uses[best])) best = x;
+    }
+    if (best < 0) break;
+    regs.host[best] = regs.count;
+    regs.cached[regs.count++] = best;
+  }
+  
+  uint8_t *start = jit->code + jit->used;
+  jit->used += emit_block(start, &regs, block, address, profile) - start;
+  return (native_block_t) (void *) start;
+}
+
+// drops all compiled code so the buffer can be reused, blocks get recompiled on their next run
+static void jit_flush(chip8_t *chip8) {
+  for (uint32_t a = 0; a < RAM_SIZE; a++) {
+    if (chip8->block_cache->blocks[a])
+      chip8->block_cache->blocks[a]->native = NULL;
+  }
+  chip8->jit->used = 0;
+}
+
+// like emulate_block but runs whole blocks as native code
+static uint32_t emulate_block_jit(chip8_t *chip8, const uint32_t budget) {
+  const uint16_t address = chip8->PC;
+  block_t *block = lookup_block(chip8, address);
+  if (!block) {
+    emulate_instruction(chip8);
+    return 1;
+  }
+  
+  // native code always runs the whole block, so a partial run at the end of a burst is interpreted
+  const uint32_t length = block->length;
+  if (length > budget) {
+    interpret_block(chip8, block, budget);
+    return budget;
+  }
+  
+  if (!block->native) {
+    block->native = jit_compile(chip8->jit, block, address, chip8->profile);
+    if (!block->native) {
+      jit_flush(chip8);
+      block->native = jit_compile(chip8->jit, block, address, chip8->profile);
+    }
+  }
+  
+  // the buffer can't be made writable or executable again, so the block is interpreted instead
+  if (!block->native || !jit_protect(chip8->jit, true)) {
+    interpret_block(chip8, block, length);
+    return length;
+  }
+  
+  block->native(chip8);
+  return length;
+}
+#endif
+
+// returns the length in instructions of the loop PC sits at if it can't exit before the next timer
+// tick or key event: FX0A with no key down, 00FD, a jump to itself, or a delay timer poll of FX07,
+// 3XNN/4XNN and a jump back to the FX07 whose skip won't be taken this frame. 0 if it isn't one
+static uint32_t idle_loop_length(const chip8_t *chip8) {
+  const uint16_t pc = chip8->PC;
+  const uint16_t first = (chip8->ram[pc] << 8) | chip8->ram[(pc + 1) & RAM_MASK];
+  
+  if ((first & 0xF0FF) == 0xF00A)
+    return chip8->keypad ? 0 : 1;
+  
+  if (first == 0x00FD) return 1;
+  
+  // 1NNN can only reach the first 4k, jumps to self are opcodes no address above that matches
+  const uint32_t self_jump = pc < 0x1000 ? 0x1000u | pc : UINT32_MAX;
+  if (first == self_jump) return 1;
+  
+  if ((first & 0xF0FF) == 0xF007) {
+    const uint16_t skip = (chip8->ram[(pc + 2) & RAM_MASK] << 8) | chip8->ram[(pc + 3) & RAM_MASK];
+    const uint16_t jump = (chip8->ram[(pc + 4) & RAM_MASK] << 8) | chip8->ram[(pc + 5) & RAM_MASK];
+    if (jump != self_jump || (skip & 0x0F00) != (first & 0x0F00)) return 0;
+    
+    // FX07 loads the delay timer, which stays put until the end of the burst
+    if ((skip & 0xF000) == 0x3000 && chip8->delay_timer != (skip & 0xFF)) return 3;
+    if ((skip & 0xF000) == 0x4000 && chip8->delay_timer == (skip & 0xFF)) return 3;
+  }
+  
+  return 0;
+}
+
+// skips as many whole iterations of an idle loop as fit in remaining cycles and returns how many
+// cycles that consumed. The machine ends up exactly as if it had run them
+static uint32_t skip_idle(chip8_t *chip8, const uint32_t remaining) {
+  const uint32_t length = idle_loop_length(chip8);
+  if (!length) return 0;
+  
+  const uint32_t skipped = remaining - remaining % length;
+  if (chip8->profile) chip8->profile->idle_cycles += skipped;
+  if (chip8->trace && skipped) trace_begin(chip8->trace, TRACE_SKIP, chip8->PC, skipped, chip8->V);
+  if (skipped && length == 3)
+    chip8->V[chip8->ram[chip8->PC] & 0xF] = chip8->delay_timer; // the only effect of a poll loop
+  return skipped;
+}
+
+// runs count instructions with the configured engine. Whenever control flow doesn't move forward,
+// PC is checked for an idle loop so the rest of the burst isn't spent spinning in it
+static void run_burst(chip8_t *chip8, const config_t *config, const uint32_t count) {
+  switch (config->engine) {
+    case ENGINE_CACHED:
+      for (uint32_t i = 0; i < count; ) {
+        const uint16_t pc = chip8->PC;
+        emulate_instruction_cached(chip8);
+        i++;
+        if (chip8->PC <= pc) i += skip_idle(chip8, count - i);
+      }
+      break;
+    
+    case ENGINE_BLOCK:
+      for (uint32_t i = 0; i < count; ) {
+        const uint16_t pc = chip8->PC;
+        const uint32_t executed = emulate_block(chip8, count - i);
+        i += executed;
+        if (chip8->PC < pc + 2 * executed) i += skip_idle(chip8, count - i);
+      }
+      break;
+    
+#ifdef JIT_SUPPORTED
+    case ENGINE_JIT:
+      for (uint32_t i = 0; i < count; ) {
+        const uint16_t pc = chip8->PC;
+        const uint32_t executed = emulate_block_jit(chip8, count - i);
+        i += executed;
+        if (chip8->PC < pc + 2 * executed) i += skip_idle(chip8, count - i);
+      }
+      break;
+#endif
+    
+    // each quirk profile has its own copy of the loop, so the switch engine never tests a quirk
+    default:
+      switch (chip8->quirk_profile) {
+#define QUIRK_PROFILE_LOOP(id, name, suffix, bits) \
+        case id: \
+          for (uint32_t i = 0; i < count; ) { \
+            const uint16_t pc = chip8->PC; \
+            emulate_instruction_q(chip8, bits); \
+            i++; \
+            if (chip8->PC <= pc) i += skip_idle(chip8, count - i); \
+          } \
+          break;
+        QUIRK_PROFILES(QUIRK_PROFILE_LOOP)
+#undef QUIRK_PROFILE_LOOP
+      }
+      break;
+  }
+}
+
+#define ANALYSIS_MAGIC 0x46433843u  // "C8CF" in a little endian file
+#define ANALYSIS_VERSION 2
+
+// Blocks of a ROM found before it runs, for a ROM that starts at 0x200 and only takes the paths its
+// code shows: 0x200, jump and call targets, the instructions after calls, skips and stores, and the
+// cuts of blocks at MAX_BLOCK_LENGTH. Jumps through BNNN and returns don't show their targets, returns
+// are covered by the block after each call. A burst that runs out of cycles leaves PC inside a block,
+// those blocks are left to be translated when they first run
+typedef struct {
+  uint16_t *starts;           // ascending, without the blocks the ROM stores over
+  uint32_t count;
+  uint32_t self_modifying;    // blocks left out because a FX33, FX55 or 5XY2 on a path writes into them
+} analysis_t;
+
+// Analysis cache file header, followed by count 16 bit block starts
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t hash;              // rom_hash of the machine's memory before it ran, fonts and all
+  uint32_t count;
+  uint32_t self_modifying;
+} analysis_header_t;
+
+#ifndef CHIP8_LIBRARY
+// walks the control flow graph of the loaded ROM block by block, splitting blocks exactly where
+// translate_block will. I is followed through ANNN and F000 NNNN within a block, so stores with a
+// known address mark the bytes they write
+static bool analyze_rom(const chip8_t *chip8, analysis_t *analysis) {
+  const uint8_t *ram = chip8->ram;
+  uint8_t *lengths = calloc(RAM_SIZE, 1);     // block length by start address, 0 where none starts
+  bool *queued = calloc(RAM_SIZE, sizeof(bool));
+  bool *written = calloc(RAM_SIZE, sizeof(bool));
+  uint16_t *worklist = malloc(RAM_SIZE * sizeof(uint16_t)); // every address is queued once at most
+  *analysis = (analysis_t) {0};
+  bool ok = lengths && queued && written && worklist;
+  
+  uint32_t pending = 0;
+#define ANALYSIS_QUEUE(address) \
+  do { \
+    const uint32_t target = (address); \
+    if (target < RAM_SIZE && !queued[target]) { \
+      queued[target] = true; \
+      worklist[pending++] = target; \
+    } \
+  } while (0)
+  
+  if (ok) ANALYSIS_QUEUE(0x200);
+  while (pending) {
+    const uint32_t start = worklist[--pending];
+    uint32_t a = start;
+    uint32_t length = 0;
+    int32_t I = -1;  // -1 while unknown
+    
+    for (;;) {
+      decoded_t op;
+      op.inst = decode_instruction((ram[a] << 8) | ram[(a + 1) & RAM_MASK]);
+      op.handler = decode_handler(&op.inst, chip8->quirk_profile);
+      const uint16_t opcode = op.inst.opcode;
+      const uint16_t following = (ram[(a + 2) & RAM_MASK] << 8) | ram[(a + 3) & RAM_MASK];
+      length++;
+      a += 2;
+      
+      uint32_t store_length = 0;
+      if (opcode >> 12 == 0xA) I = op.inst.NNN;
+      else if (op.handler == op_F000) I = following;
+      else if ((opcode & 0xF0FF) == 0xF033) store_length = 3;
+      else if ((opcode & 0xF0FF) == 0xF055) store_length = op.inst.X + 1;
+      else if (op.handler == op_5XY2) store_length = abs(op.inst.X - op.inst.Y) + 1;
+      if (store_length && I >= 0) {
+        for (uint32_t i = 0; i < store_length; i++)
+          written[(I + i) & RAM_MASK] = true;
+      }
+      
+      // FX55 and FX65 move I in some quirk profiles
+      const uint16_t f_op = opcode & 0xF0FF;
+      if (f_op == 0xF01E || f_op == 0xF029 || f_op == 0xF030 || f_op == 0xF055 || f_op == 0xF065) I = -1;
+      
+      if (ends_block(&op)) {
+        if (op.handler == op_1NNN) {
+          ANALYSIS_QUEUE(op.inst.NNN);
+        } else if (op.handler == op_2NNN) {
+          ANALYSIS_QUEUE(op.inst.NNN);
+          ANALYSIS_QUEUE(a);
+        } else if (op.handler == op_F000) {
+          ANALYSIS_QUEUE(a + 2);
+        } else if (op.handler == op_00EE || op.handler == op_00FD || opcode >> 12 == 0xB) {
+          // returns, halts and computed jumps have no successor the code shows
+        } else if (op.handler == op_5XY2 || opcode >> 12 == 0xF) {
+          ANALYSIS_QUEUE(a);  // stores and FX0A carry on after themselves
+        } else {
+          // a skip lands after the next instruction, which may be a 4 byte F000 NNNN
+          ANALYSIS_QUEUE(a);
+          ANALYSIS_QUEUE(a + 2);
+          if (following == 0xF000) ANALYSIS_QUEUE(a + 4);
+        }
+        break;
+      }
+      if (length == MAX_BLOCK_LENGTH || a >= RAM_SIZE) {
+        ANALYSIS_QUEUE(a);
+        break;
+      }
+    }
+    lengths[start] = length;
+  }
+#undef ANALYSIS_QUEUE
+  
+  // blocks the ROM writes into would only be translated again after the store
+  uint32_t count = 0;
+  for (uint32_t start = 0; ok && start < RAM_SIZE; start++) {
+    if (!lengths[start]) continue;
+    bool stored = false;
+    for (uint32_t i = start; i < start + 2u * lengths[start] && i < RAM_SIZE; i++)
+      stored |= written[i];
+    if (stored) {
+      analysis->self_modifying++;
+      lengths[start] = 0;
+      continue;
+    }
+    count++;
+  }
+  
+  analysis->starts = ok ? malloc((count ? count : 1) * sizeof(uint16_t)) : NULL;
+  ok = analysis->starts != NULL;
+  for (uint32_t start = 0; ok && start < RAM_SIZE; start++) {
+    if (lengths[start]) analysis->starts[analysis->count++] = start;
+  }
+  
+  free(lengths);
+  free(queued);
+  free(written);
+  free(worklist);
+  if (!ok) SDL_Log("Unable to allocate ROM analysis\n");
+  return ok;
+}
+
+static void analysis_finish(analysis_t *analysis) {
+  free(analysis->starts);
+  *analysis = (analysis_t) {0};
+}
+
+// reads a cached analysis of memory with this hash, false if there is none for it
+static bool analysis_load(const char *path, const uint64_t hash, analysis_t *analysis) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return false;
+  
+  analysis_header_t header;
+  bool ok = fread(&header, sizeof header, 1, file) == 1 && header.magic == ANALYSIS_MAGIC &&
+            header.version == ANALYSIS_VERSION && header.hash == hash && header.count <= RAM_SIZE;
+  *analysis = (analysis_t) {.count = header.count, .self_modifying = header.self_modifying};
+  analysis->starts = ok ? malloc((header.count ? header.count : 1) * sizeof(uint16_t)) : NULL;
+  ok = analysis->starts && fread(analysis->starts, sizeof(uint16_t), header.count, file) == header.count;
+  fclose(file);
+  if (!ok) analysis_finish(analysis);
+  return ok;
+}
+
+static void analysis_save(const char *path, const uint64_t hash, const analysis_t *analysis) {
+  FILE *file = fopen(path, "wb");
+  const analysis_header_t header = {
+    .magic = ANALYSIS_MAGIC,
+    .version = ANALYSIS_VERSION,
+    .hash = hash,
+    .count = analysis->count,
+    .self_modifying = analysis->self_modifying,
+  };
+  const bool ok = file && fwrite(&header, sizeof header, 1, file) == 1 &&
+                  fwrite(analysis->starts, sizeof(uint16_t), analysis->count, file) == analysis->count;
+  if (!file || fclose(file) != 0 || !ok)
+    SDL_Log("Failed to write ROM analysis cache: %s\n", path);
+}
+
+// analyzes the loaded ROM, or reads the analysis back from the cache directory when one is configured.
+// The cache is keyed by the hash of the untouched memory image, so it has to be called before running.
+// Only the walk is cached, blocks are translated again on every start since native code points at the
+// block structures and handlers of this process
+static bool analysis_init(const chip8_t *chip8, const config_t *config, analysis_t *analysis) {
+  if (!config->precompile_cache) return analyze_rom(chip8, analysis);
+  
+  const uint64_t hash = rom_hash(chip8->ram, RAM_SIZE);
+  char path[4096];
+  snprintf(path, sizeof path, "%s/%016llx.c8cfg", config->precompile_cache, (unsigned long long) hash);
+  if (analysis_load(path, hash, analysis)) return true;
+  
+  if (!analyze_rom(chip8, analysis)) return false;
+  analysis_save(path, hash, analysis);
+  return true;
+}
+
+// translates every analyzed block ahead of time for the engine in use: decode cache entries for the
+// cached engine, blocks for the block engine and native code as well for the JIT. Returns the number of
+// blocks prepared, the switch engine has nothing to prepare
+static uint32_t precompile(chip8_t *chip8, const analysis_t *analysis) {
+  uint32_t prepared = 0;
+  for (uint32_t b = 0; b < analysis->count; b++) {
+    const uint16_t start = analysis->starts[b];
+    
+    if (chip8->decode_cache) {
+      // the same straight line run a block would cover
+      for (uint32_t a = start, length = 0; a < RAM_SIZE && length < MAX_BLOCK_LENGTH; a += 2, length++) {
+        decoded_t *entry = &chip8->decode_cache[a];
+        if (!entry->handler) {
+          entry->inst = decode_instruction((chip8->ram[a] << 8) | chip8->ram[(a + 1) & RAM_MASK]);
+          entry->handler = decode_handler(&entry->inst, chip8->quirk_profile);
+        }
+        if (ends_block(entry)) break;
+      }
+      prepared++;
+    } else if (chip8->block_cache) {
+      block_t *block = lookup_block(chip8, start);
+      if (!block) break;
+#ifdef JIT_SUPPORTED
+      // native code only fills half the buffer, the rest is left for the blocks only found at run time
+      // so the first of them doesn't flush everything compiled here
+      if (chip8->jit && !block->native && chip8->jit->used < chip8->jit->size / 2)
+        block->native = jit_compile(chip8->jit, block, start, chip8->profile);
+#endif
+      prepared++;
+    }
+  }
+  return prepared;
+}
+
+// seeds the engine's caches with the blocks of the loaded ROM before it starts
+static bool precompile_rom(chip8_t *chip8, const config_t *config) {
+  analysis_t analysis;
+  if (!analysis_init(chip8, config, &analysis)) return false;
+  
+  const uint32_t prepared = precompile(chip8, &analysis);
+  SDL_Log("Precompiled %u of %u blocks, %u more are stored over by the ROM\n", prepared, analysis.count,
+          analysis.self_modifying);
+  analysis_finish(&analysis);
+  return true;
+}
+
+// expands one display row into a RGBA8888 texel per pixel, colored by its bits in each plane
+static inline void expand_row(const display_t *display, const uint32_t y, uint32_t *row, const uint32_t width,
+                              const uint32_t palette[1 << DISPLAY_PLANES]) {
+  for (uint32_t w = 0; w < width / 64; w++) {
+    uint64_t plane0 = display->rows[0][y][w];
+    uint64_t plane1 = display->rows[1][y][w];
+    uint32_t *texel = &row[64 * w];
+    if (!plane1) {
+      // the common single plane case picks between two colors
+      for (uint32_t x = 0; x < 64; x++, plane0 <<= 1)
+        texel[x] = (plane0 >> 63) ? palette[1] : palette[0];
+      continue;
+    }
+    for (uint32_t x = 0; x < 64; x++, plane0 <<= 1, plane1 <<= 1)
+      texel[x] = palette[plane0 >> 63 | (plane1 >> 63) << 1];
+  }
+}
+
+// creates the named shared memory object frames are exported to, consumers may already have it open
+static bool export_init(chip8_t *chip8, const config_t *config) {
+  if (!config->export_shm) return true;
+  
+#ifdef MMAP_SUPPORTED
+  export_t *export = NULL;
+  const int fd = shm_open(config->export_shm, O_RDWR | O_CREAT, 0644);
+  if (fd >= 0 && ftruncate(fd, sizeof(export_t)) == 0) {
+    void *map = mmap(NULL, sizeof(export_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    export = map == MAP_FAILED ? NULL : map;
+  }
+  if (fd >= 0) close(fd);
+  if (!export) {
+    SDL_Log("Unable to create shared memory frame export %s\n", config->export_shm);
+    return false;
+  }
+  
+  // a consumer that already had the object open sees latest go back to 0, no frame yet
+  memset(export, 0, sizeof(export_t));
+  export->magic = EXPORT_MAGIC;
+  export->version = EXPORT_VERSION;
+  export->format = config->export_format;
+  export->slot_count = EXPORT_SLOTS;
+  const uint32_t palette[1 << DISPLAY_PLANES] = {config->background_color, config->foreground_color,
+                                                  config->plane2_color, config->blend_color};
+  memcpy(export->palette, palette, sizeof palette);
+  
+  chip8->export = export;
+  return true;
+#else
+  (void) chip8;
+  SDL_Log("Shared memory frame export is not supported on this host\n");
+  return false;
+#endif
+}
+
+static void export_finish(chip8_t *chip8, const config_t *config) {
+  if (!chip8->export) return;
+#ifdef MMAP_SUPPORTED
+  munmap(chip8->export, sizeof(export_t));
+  shm_unlink(config->export_shm);
+#else
+  (void) config;
+#endif
+  chip8->export = NULL;
+}
+
+// writes the display to the next slot and makes it the latest, in place of the frame EXPORT_SLOTS ago
+static void export_publish(export_t *export, const display_t *display) {
+  const uint64_t sequence = atomic_load_explicit(&export->latest, memory_order_relaxed) + 1;
+  export_slot_t *slot = &export->slots[sequence % EXPORT_SLOTS];
+  
+  // the cleared sequence has to be visible before any of the new frame is
+  atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  
+  slot->width = display_width(display);
+  slot->height = display_height(display);
+  if (export->format == EXPORT_RGBA) {
+    for (uint32_t y = 0; y < slot->height; y++)
+      expand_row(display, y, slot->pixels[y], slot->width, export->palette);
+  } else {
+    memcpy(slot->rows, display->rows, sizeof slot->rows);
+  }
+  
+  atomic_store_explicit(&slot->sequence, sequence, memory_order_release);
+  atomic_store_explicit(&export->latest, sequence, memory_order_release);
+}
+
+static void sdl_finish(sdl_t *sdl) {
+  SDL_DelEventWatch(input_watch, &sdl->input);
+  if (sdl->texture)
+    SDL_DestroyTexture(sdl->texture);
+  SDL_DestroyRenderer(sdl->renderer);
+  SDL_DestroyWindow(sdl->window);
+  SDL_CloseAudioDevice(sdl->device);
+  SDL_Quit();  // ends all running sdl subsystems
+}
+
+static bool clear_screen(const sdl_t *sdl) {
+  // sets draw color to config background color
+  const SDL_Color bg = sdl->colors[0];
+  if (SDL_SetRenderDrawColor(sdl->renderer, bg.r, bg.g, bg.b, bg.a) != 0) {
+    SDL_Log("Unable to set renderer draw color: %s\n", SDL_GetError());
+    return false;
+  }
+  
+  // draws a blank background
+  if (SDL_RenderClear(sdl->renderer) != 0) {
+    SDL_Log("Error clearing background: %s\n", SDL_GetError());
+    return false;
+  }
+  
+  return true;
+}
+
+static void update_screen_rect(const sdl_t *sdl, const config_t *config, const display_t *display) {
+  const uint32_t width = display_width(display);
+  const uint32_t height = display_height(display);
+  const uint32_t window_width = config->window_width * config->scale_factor;
+  const uint32_t window_height = config->window_height * config->scale_factor;
+  SDL_Rect rect;
+  
+  // loop through display and render a rectangle for each pixel, hires ones are half the size
+  for (uint32_t y = 0; y < height; y++) {
+    rect.y = y * window_height / height;
+    rect.h = (y + 1) * window_height / height - rect.y;
+    
+    for (uint32_t x = 0; x < width; x++) {
+      rect.x = x * window_width / width;
+      rect.w = (x + 1) * window_width / width - rect.x;
+      
+      const uint32_t shift = 63 - x % 64;
+      const uint32_t color = (display->rows[0][y][x / 64] >> shift & 1) | (display->rows[1][y][x / 64] >> shift & 1) << 1;
+      const SDL_Color c = sdl->colors[color];
+      SDL_SetRenderDrawColor(sdl->renderer, c.r, c.g, c.b, c.a);
+      SDL_RenderFillRect(sdl->renderer, &rect);
+    }
+  }
+}
+
+static void update_screen_texture(const sdl_t *sdl, const display_t *display, const uint64_t dirty_rows) {
+  const uint32_t width = display_width(display);
+  const uint32_t height = display_height(display);
+  
+  // upload each contiguous run of dirty rows, the texture keeps the rest from previous frames
+  uint32_t y = 0;
+  while (y < height) {
+    if (!(dirty_rows & (1ull << y))) {
+      y++;
+      continue;
+    }
+    
+    uint32_t run_end = y;
+    while (run_end < height && (dirty_rows & (1ull << run_end)))
+      run_end++;
+    
+    const SDL_Rect run = {0, y, width, run_end - y};
+    void *pixels;
+    int pitch;
+    
+    // write one RGBA8888 texel per chip8 pixel straight into the locked texture
+    if (SDL_LockTexture(sdl->texture, &run, &pixels, &pitch) != 0) {
+      SDL_Log("Unable to lock framebuffer texture: %s\n", SDL_GetError());
+      return;
+    }
+    
+    for (; y < run_end; y++)
+      expand_row(display, y, (uint32_t *) ((uint8_t *) pixels + (y - run.y) * pitch), width, sdl->palette);
+    
+    SDL_UnlockTexture(sdl->texture);
+  }
+  
+  // a single copy scales the part of the texture the current mode uses up to the window
+  const SDL_Rect used = {0, 0, width, height};
+  SDL_RenderCopy(sdl->renderer, sdl->texture, &used, NULL);
+}
+
+// rows that differ between two displays, all of them if the mode changed
+static uint64_t display_diff(const display_t *a, const display_t *b) {
+  if (a->hires != b->hires) return UINT64_MAX;
+  
+  uint64_t dirty = 0;
+  for (uint32_t plane = 0; plane < DISPLAY_PLANES; plane++)
+    for (uint32_t y = 0; y < DISPLAY_HEIGHT; y++)
+      for (uint32_t w = 0; w < DISPLAY_WORDS; w++)
+        if (a->rows[plane][y][w] != b->rows[plane][y][w]) dirty |= 1ull << y;
+  return dirty;
+}
+
+// draws the display into the back buffer and returns whether there was anything to present
+static bool update_screen(const sdl_t *sdl, const config_t *config, const display_t *display, const uint64_t dirty_rows) {
+  // nothing changed since the last update so the window already shows this display
+  if (!dirty_rows) return false;
+  
+  // the rect renderer always repaints everything since the back buffer is undefined after a present
+  if (config->renderer == RENDERER_TEXTURE)
+    update_screen_texture(sdl, display, dirty_rows);
+  else
+    update_screen_rect(sdl, config, display);
+  return true;
+}
+
+static void framebuffer_init(framebuffer_t *framebuffer) {
+  framebuffer->back = 0;
+  framebuffer->front = 1;
+  atomic_init(&framebuffer->latest, 2);
+}
+
+// makes the back buffer the newest frame and returns whether the frame it replaced was never taken
+static bool framebuffer_publish(framebuffer_t *framebuffer) {
+  const uint32_t replaced = atomic_exchange_explicit(&framebuffer->latest, framebuffer->back | FRAME_FRESH,
+                                                     memory_order_acq_rel);
+  framebuffer->back = replaced & 3;
+  return replaced & FRAME_FRESH;
+}
+
+// the newest frame if it hasn't been taken yet, otherwise NULL. It stays valid until the next take
+static const frame_t *framebuffer_take(framebuffer_t *framebuffer) {
+  if (!(atomic_load_explicit(&framebuffer->latest, memory_order_relaxed) & FRAME_FRESH)) return NULL;
+  framebuffer->front = atomic_exchange_explicit(&framebuffer->latest, framebuffer->front, memory_order_acq_rel) & 3;
+  return &framebuffer->frames[framebuffer->front];
+}
+
+// publishes how many samples are left before the sound timer runs out, the callback counts them down
+static void update_audio(sdl_t *sdl, const chip8_t *chip8) {
+  // fast forward would turn every beep into a click and rewinding would play it backwards, so both are muted
+  const uint32_t gate = (chip8->turbo || chip8->rewinding) ? 0 : chip8->sound_timer * sdl->audio.samples_per_tick;
+  atomic_store_explicit(&sdl->audio.gate, gate, memory_order_relaxed);
+}
+#endif
+
+static void update_timers(chip8_t *chip8) {
+  if (chip8->delay_timer)
+    chip8->delay_timer--;
+  
+  if (chip8->sound_timer)
+    chip8->sound_timer--;
+  
+  if (chip8->trace) trace_frame(chip8->trace, chip8->V, chip8->delay_timer, chip8->sound_timer);
+}
+
+#ifndef CHIP8_LIBRARY
+// Paces the emulation thread against absolute FRAME_RATE deadlines, so emulated time can't drift from real time
+typedef struct {
+  uint64_t frequency;     // performance counter ticks per second
+  uint64_t origin;        // performance counter value at the deadline of frame 0
+  uint64_t frame;         // frames consumed since origin, emulated or dropped
+} scheduler_t;
+
+// starts a new timeline at the current time, used at startup and when resuming from pause
+static void scheduler_reset(scheduler_t *scheduler) {
+  scheduler->frequency = SDL_GetPerformanceFrequency();
+  scheduler->origin = SDL_GetPerformanceCounter();
+  scheduler->frame = 0;
+}
+
+// deadlines are computed from the origin every time rather than accumulated, so rounding never adds up
+static uint64_t scheduler_deadline(const scheduler_t *scheduler, const uint64_t frame) {
+  return scheduler->origin + frame / FRAME_RATE * scheduler->frequency +
+         frame % FRAME_RATE * scheduler->frequency / FRAME_RATE;
+}
+
+// number of frames whose deadline has passed, dropping any beyond MAX_CATCHUP_FRAMES
+static uint32_t scheduler_due_frames(scheduler_t *scheduler) {
+  const uint64_t elapsed = SDL_GetPerformanceCounter() - scheduler->origin;
+  const uint64_t reached = elapsed / scheduler->frequency * FRAME_RATE +
+                           elapsed % scheduler->frequency * FRAME_RATE / scheduler->frequency + 1;
+  if (reached <= scheduler->frame) return 0;
+  
+  uint64_t due = reached - scheduler->frame;
+  if (due > MAX_CATCHUP_FRAMES) {
+    scheduler->frame += due - MAX_CATCHUP_FRAMES; // too far behind to catch up without a visible burst
+    due = MAX_CATCHUP_FRAMES;
+  }
+  return due;
+}
+
+// sleeps until the next frame deadline, waking up to a millisecond or so late. A precise wait sleeps all
+// but the last couple of milliseconds and spins the rest, hitting the deadline at the cost of a busy core
+static void scheduler_wait(const scheduler_t *scheduler, const bool precise) {
+  const uint64_t deadline = scheduler_deadline(scheduler, scheduler->frame);
+  
+  for (;;) {
+    const uint64_t now = SDL_GetPerformanceCounter();
+    if (now >= deadline) return;
+    
+    if (!precise) {
+      // the whole wait is one sleep, with nanosecond resolution where there is a POSIX clock
+#ifdef __unix__
+      const uint64_t remaining_ns = (deadline - now) * 1000000000 / scheduler->frequency;
+      nanosleep(&(struct timespec) {.tv_sec = remaining_ns / 1000000000, .tv_nsec = remaining_ns % 1000000000}, NULL);
+#else
+      SDL_Delay(((deadline - now) * 1000 + scheduler->frequency - 1) / scheduler->frequency);
+#endif
+      return;
+    }
+    
+    const uint64_t remaining_ms = (deadline - now) * 1000 / scheduler->frequency;
+    if (remaining_ms > 2)
+      SDL_Delay(remaining_ms - 2);
+  }
+}
+
+// sleeps until a slice of the current frame is due. Slices only decide when input is sampled, so unlike
+// frame deadlines these aren't spun and may start up to a millisecond early or late
+static void scheduler_wait_slice(const scheduler_t *scheduler, const uint32_t slice, const uint32_t slices) {
+  const uint64_t start = scheduler_deadline(scheduler, scheduler->frame);
+  const uint64_t deadline = start + (scheduler_deadline(scheduler, scheduler->frame + 1) - start) * slice / slices;
+  const uint64_t now = SDL_GetPerformanceCounter();
+  if (now < deadline)
+    SDL_Delay((deadline - now) * 1000 / scheduler->frequency);
+}
+#endif
+
+// Splits clock_speed cycles per second into per frame bursts. The division remainder is carried to
+// the next frame instead of dropped, so every clock speed runs exactly its rate over FRAME_RATE frames
+typedef struct {
+  uint32_t clock_speed;   // cycles per second
+  uint32_t remainder;     // cycles owed from earlier frames, in 1/FRAME_RATE units
+} cycle_budget_t;
+
+static cycle_budget_t cycle_budget(const uint32_t clock_speed) {
+  return (cycle_budget_t) { .clock_speed = clock_speed, .remainder = 0 };
+}
+
+// number of cycles to run in the next frame
+static uint32_t cycle_budget_next(cycle_budget_t *budget) {
+  const uint64_t total = (uint64_t) budget->clock_speed + budget->remainder;
+  budget->remainder = total % FRAME_RATE;
+  return total / FRAME_RATE;
+}
+
+#define REWIND_BUFFER_SIZE (4 << 20) // bytes of compressed history, minutes of a typical game
+
+// one frame of history, the XOR of a snapshot against the one before it encoded by delta_encode
+typedef struct {
+  uint32_t offset;        // into rewind_t::data
+  uint32_t length;
+} rewind_entry_t;
+
+// Per frame history for rewinding. Only the newest snapshot is kept whole, each entry holds the
+// delta that turns a snapshot back into its predecessor, and the oldest entries are dropped for space
+typedef struct {
+  savestate_t head;           // newest snapshot
+  bool has_head;
+  uint8_t *data;              // REWIND_BUFFER_SIZE bytes, entries never wrap around its end
+  uint8_t *scratch;           // encoding buffer for one worst case delta
+  uint32_t write;             // offset the next entry goes to
+  rewind_entry_t *entries;    // circular, oldest at entries[first]
+  uint32_t capacity;          // most entries kept, one per frame
+  uint32_t first;
+  uint32_t count;
+} rewind_t;
+
+// worst case is alternating single changed and unchanged bytes, 4 bytes of header per changed byte
+#define DELTA_MAX_SIZE (5 * sizeof(savestate_t))
+
+#ifndef CHIP8_LIBRARY
+// XORs two snapshots and run length encodes the result as repeated (zero run, literal run, literal
+// bytes) groups with 16 bit little endian run lengths. Returns the encoded length
+static uint32_t delta_encode(const uint8_t *a, const uint8_t *b, const uint32_t size, uint8_t *out) {
+  uint32_t length = 0;
+  
+  for (uint32_t i = 0; i < size; ) {
+    uint32_t zeros = 0;
+    while (i < size && a[i] == b[i] && zeros < UINT16_MAX) {
+      zeros++;
+      i++;
+    }
+    uint32_t literals = 0;
+    while (i + literals < size && a[i + literals] != b[i + literals] && literals < UINT16_MAX)
+      literals++;
+    
+    // a trailing run of zeros needs no group
+    if (!literals && i == size) break;
+    
+    out[length++] = zeros & 0xFF;
+    out[length++] = zeros >> 8;
+    out[length++] = literals & 0xFF;
+    out[length++] = literals >> 8;
+    for (uint32_t j = 0; j < literals; j++, i++)
+      out[length++] = a[i] ^ b[i];
+  }
+  
+  return length;
+}
+
+// XORs an encoded delta back into a snapshot
+static void delta_apply(uint8_t *state, const uint8_t *delta, const uint32_t length) {
+  uint32_t at = 0;
+  for (uint32_t i = 0; i < length; ) {
+    at += delta[i] | delta[i + 1] << 8;
+    const uint32_t literals = delta[i + 2] | delta[i + 3] << 8;
+    i += 4;
+    for (uint32_t j = 0; j < literals; j++)
+      state[at++] ^= delta[i++];
+  }
+}
+
+static bool rewind_init(rewind_t *history, const uint32_t frames) {
+  *history = (rewind_t) {
+    .data = malloc(REWIND_BUFFER_SIZE),
+    .scratch = malloc(DELTA_MAX_SIZE),
+    .entries = malloc(frames * sizeof(rewind_entry_t)),
+    .capacity = frames,
+  };
+  
+  if (!history->data || !history->scratch || !history->entries) {
+    SDL_Log("Unable to allocate rewind history\n");
+    return false;
+  }
+  return true;
+}
+
+static void rewind_finish(rewind_t *history) {
+  free(history->data);
+  free(history->scratch);
+  free(history->entries);
+}
+
+static void rewind_drop_oldest(rewind_t *history) {
+  history->first = (history->first + 1) % history->capacity;
+  history->count--;
+}
+
+// records the machine as the newest snapshot, called once per emulated frame
+static void rewind_push(rewind_t *history, const chip8_t *chip8) {
+  savestate_t current;
+  chip8_save(chip8, &current);
+  
+  if (!history->has_head) {
+    history->head = current;
+    history->has_head = true;
+    return;
+  }
+  
+  const uint32_t length = delta_encode((const uint8_t *) &history->head, (const uint8_t *) &current,
+                                       sizeof current, history->scratch);
+  
+  // entries live in ascending age order from write upwards, then from 0 up to write. Wrapping
+  // first drops everything past write, which is the oldest history
+  if (history->write + length > REWIND_BUFFER_SIZE) {
+    while (history->count && history->entries[history->first].offset >= history->write)
+      rewind_drop_oldest(history);
+    history->write = 0;
+  }
+  while (history->count) {
+    const rewind_entry_t *oldest = &history->entries[history->first];
+    const bool overlaps = oldest->offset >= history->write && oldest->offset < history->write + length;
+    if (!overlaps && history->count < history->capacity) break;
+    rewind_drop_oldest(history);
+  }
+  
+  memcpy(&history->data[history->write], history->scratch, length);
+  history->entries[(history->first + history->count) % history->capacity] =
+    (rewind_entry_t) {.offset = history->write, .length = length};
+  history->count++;
+  history->write += length;
+  history->head = current;
+}
+
+// forgets all history, for when the machine switches to another ROM
+static void rewind_clear(rewind_t *history) {
+  history->has_head = false;
+  history->write = 0;
+  history->first = 0;
+  history->count = 0;
+}
+
+// steps the machine back one frame, false once the history is used up
+static bool rewind_step(rewind_t *history, chip8_t *chip8) {
+  if (!history->count) return false;
+  
+  const rewind_entry_t newest = history->entries[(history->first + history->count - 1) % history->capacity];
+  delta_apply((uint8_t *) &history->head, &history->data[newest.offset], newest.length);
+  history->count--;
+  history->write = newest.offset;
+  
+  return chip8_restore(chip8, &history->head);
+}
+
+// FNV-1a hash of the display, used to compare final frames between runs
+static uint64_t display_hash(const chip8_t *chip8) {
+  const display_t *display = &chip8->display;
+  const uint32_t height = display_height(display);
+  const uint32_t words = display_width(display) / 64;
+  uint64_t hash = 0xCBF29CE484222325;
+  
+  // the mode and planes past the first only count once used, so lores single plane displays hash as they always have
+  if (display->hires) {
+    hash ^= 0xFF;
+    hash *= 0x100000001B3;
+  }
+  for (uint32_t plane = 0; plane < DISPLAY_PLANES; plane++) {
+    uint64_t used = plane == 0;
+    for (uint32_t y = 0; y < height && !used; y++)
+      for (uint32_t w = 0; w < words; w++)
+        used |= display->rows[plane][y][w];
+    if (!used) continue;
+    
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t w = 0; w < words; w++) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+          hash ^= display->rows[plane][y][w] >> shift & 0xFF;
+          hash *= 0x100000001B3;
+        }
+      }
+    }
+  }
+  return hash;
+}
+
+// FNV-1a hash of everything a ROM can observe, used to compare final machine states between runs
+static uint64_t state_hash(const chip8_t *chip8) {
+  uint64_t hash = display_hash(chip8);
+  const uint16_t words[] = {chip8->I, chip8->PC, chip8->delay_timer, chip8->sound_timer,
+                            chip8->stack_top};
+  
+  for (uint32_t i = 0; i < sizeof chip8->V; i++) {
+    hash ^= chip8->V[i];
+    hash *= 0x100000001B3;
+  }
+  for (uint32_t i = 0; i < sizeof words / sizeof words[0]; i++) {
+    hash ^= words[i];
+    hash *= 0x100000001B3;
+  }
+  for (uint32_t i = 0; i < RAM_SIZE; i++) {
+    hash ^= chip8->ram[i];
+    hash *= 0x100000001B3;
+  }
+  return hash;
+}
+
+// set by SIGINT/SIGTERM so an unbounded headless run can still report its final state
+static volatile sig_atomic_t headless_interrupted = 0;
+
+static void headless_signal_handler(int signum) {
+  (void) signum;
+  headless_interrupted = 1;
+}
+
+#define INPUT_LOG_MAGIC 0x4E493843u  // "C8IN" in a little endian file
+#define INPUT_LOG_VERSION 2
+
+// Input log file header. It is followed by one 16 bit little endian keypad mask per emulated frame,
+// taken just before that frame's burst, which together with the seed and clock reproduces a session
+// of the same memory image under the same quirk profile
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seed;
+  uint32_t clock_speed;
+  uint32_t quirk_profile;
+  uint32_t reserved;      // zero, keeps rom_hash aligned without implicit padding
+  uint64_t rom_hash;      // of the memory image before the first instruction ran
+} input_log_header_t;
+
+// A whole input log read back for replay
+typedef struct {
+  input_log_header_t header;
+  uint16_t *frames;
+  uint64_t frame_count;
+} input_log_t;
+
+// opens an input log for the loaded machine and writes its header, frames are appended with input_log_write
+static FILE *input_log_create(const char *path, const chip8_t *chip8, const config_t *config) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    SDL_Log("Unable to open input log for writing: %s\n", path);
+    return NULL;
+  }
+  
+  const input_log_header_t header = {
+    .magic = INPUT_LOG_MAGIC,
+    .version = INPUT_LOG_VERSION,
+    .seed = config->seed,
+    .clock_speed = config->clock_speed,
+    .quirk_profile = chip8->quirk_profile,
+    .rom_hash = rom_hash(chip8->ram, RAM_SIZE),
+  };
+  if (fwrite(&header, sizeof header, 1, file) != 1) {
+    SDL_Log("Failed to write input log: %s\n", path);
+    fclose(file);
+    return NULL;
+  }
+  return file;
+}
+
+static void input_log_write(FILE *file, const uint16_t mask) {
+  const uint8_t bytes[2] = {mask & 0xFF, mask >> 8};
+  fwrite(bytes, sizeof bytes, 1, file);
+}
+
+static bool input_log_load(const char *path, input_log_t *log) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    SDL_Log("Unable to open input log: %s\n", path);
+    return false;
+  }
+  
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  
+  bool ok = size >= (long) sizeof log->header && fread(&log->header, sizeof log->header, 1, file) == 1 &&
+            log->header.magic == INPUT_LOG_MAGIC && log->header.version == INPUT_LOG_VERSION;
+  if (!ok) {
+    SDL_Log("Not an input log from this version of the emulator: %s\n", path);
+    fclose(file);
+    return false;
+  }
+  
+  // a session that was cut off mid write just loses its last half frame
+  const size_t bytes = (size - sizeof log->header) & ~(size_t) 1;
+  uint8_t *data = malloc(bytes ? bytes : 1);
+  log->frames = malloc(bytes ? bytes : 1);
+  log->frame_count = bytes / 2;
+  ok = data && log->frames && fread(data, 1, bytes, file) == bytes;
+  fclose(file);
+  
+  if (ok) {
+    for (uint64_t f = 0; f < log->frame_count; f++)
+      log->frames[f] = data[2 * f] | data[2 * f + 1] << 8;
+  } else {
+    SDL_Log("Failed to read input log: %s\n", path);
+    free(log->frames);
+    log->frames = NULL;
+  }
+  free(data);
+  return ok;
+}
+
+// a log only replays on the ROM and quirk profile it was recorded with, anything else diverges
+static bool input_log_matches(const input_log_t *log, const chip8_t *chip8, const char *path) {
+  if (log->header.rom_hash != rom_hash(chip8->ram, RAM_SIZE)) {
+    SDL_Log("Input log %s was recorded with another ROM\n", path);
+    return false;
+  }
+  if (log->header.quirk_profile != (uint32_t) chip8->quirk_profile) {
+    SDL_Log("Input log %s was recorded with the %s quirk profile, not %s\n", path,
+            log->header.quirk_profile < QUIRK_PROFILE_COUNT ? quirk_profile_names[log->header.quirk_profile] : "unknown",
+            quirk_profile_names[chip8->quirk_profile]);
+    return false;
+  }
+  return true;
+}
+
+// Counters from one headless run
+typedef struct {
+  uint64_t cycles;
+  uint64_t frames;
+} run_stats_t;
+
+// runs the machine without SDL as fast as the host allows until a configured limit is hit.
+// With a replay log the keypad is driven from it and the run ends with the log
+static run_stats_t headless_run(chip8_t *chip8, const config_t *config, const input_log_t *replay) {
+  cycle_budget_t budget = cycle_budget(config->clock_speed);
+  run_stats_t stats = {0};
+  
+  while (chip8->state != STOPPED && !headless_interrupted) {
+    if (config->max_frames && stats.frames >= config->max_frames) break;
+    if (config->max_cycles && stats.cycles >= config->max_cycles) break;
+    
+    if (replay) {
+      if (stats.frames >= replay->frame_count) break;
+      chip8->keypad = replay->frames[stats.frames];
+    } else if (chip8->export) {
+      chip8->keypad = atomic_load_explicit(&chip8->export->keypad, memory_order_relaxed);
+    }
+    
+    // same frame structure as the windowed loop: a burst of instructions followed by a timer tick
+    uint32_t burst = cycle_budget_next(&budget);
+    if (config->max_cycles && config->max_cycles - stats.cycles < burst)
+      burst = config->max_cycles - stats.cycles;
+    run_burst(chip8, config, burst);
+    stats.cycles += burst;
+    
+    update_timers(chip8);
+    stats.frames++;
+    
+    if (chip8->export && chip8->dirty_rows) {
+      export_publish(chip8->export, &chip8->display);
+      chip8->dirty_rows = 0;
+    }
+  }
+  
+  return stats;
+}
+
+// runs one machine headless and prints its final state
+static void run_headless(chip8_t *chip8, const config_t *config, const input_log_t *replay) {
+  const uint64_t start = SDL_GetPerformanceCounter();
+  const run_stats_t stats = headless_run(chip8, config, replay);
+  const double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+  
+  // timing goes to stderr so stdout stays identical between runs and engines
+  fprintf(stderr, "seconds=%.3f ips=%.0f\n", seconds, seconds > 0 ? stats.cycles / seconds : 0);
+  
+  printf("rom=%s\n", chip8->rom_name);
+  printf("seed=%u\n", config->seed);
+  printf("cycles=%llu\n", (unsigned long long) stats.cycles);
+  printf("frames=%llu\n", (unsigned long long) stats.frames);
+  printf("PC=0x%04X\n", chip8->PC);
+  printf("I=0x%04X\n", chip8->I);
+  printf("V=");
+  for (int i = 0; i <= 0xF; i++)
+    printf("%02X%c", chip8->V[i], i == 0xF ? '\n' : ' ');
+  printf("DT=%u ST=%u\n", chip8->delay_timer, chip8->sound_timer);
+  printf("display_hash=0x%016llX\n", (unsigned long long) display_hash(chip8));
+  printf("state_hash=0x%016llX\n", (unsigned long long) state_hash(chip8));
+}
+
+// One machine run by the parallel runner
+typedef struct {
+  const char *rom_name;
+  uint32_t instance;      // index among the runs of the same ROM
+  bool ok;                // false if the ROM couldn't be loaded
+  run_stats_t stats;
+  uint64_t state_hash;
+  uint64_t display_hash;
+} job_t;
+
+// Jobs owned by one worker. The owner pops from the bottom, idle workers steal from the top
+typedef struct {
+  SDL_SpinLock lock;
+  uint32_t *jobs;         // indices into runner_t::jobs
+  uint32_t top;           // pending jobs are jobs[top..bottom)
+  uint32_t bottom;
+} job_queue_t;
+
+// Shared state of the parallel runner
+typedef struct {
+  const config_t *config;
+  job_t *jobs;
+  job_queue_t *queues;
+  uint32_t worker_count;
+} runner_t;
+
+// Thread argument for one runner worker
+typedef struct {
+  runner_t *runner;
+  uint32_t id;
+} worker_t;
+
+// takes the next job off the bottom of our own queue, or the top of someone else's
+static bool runner_next_job(runner_t *runner, const uint32_t id, uint32_t *job) {
+  job_queue_t *own = &runner->queues[id];
+  bool found = false;
+  
+  SDL_AtomicLock(&own->lock);
+  if (own->top < own->bottom) {
+    *job = own->jobs[--own->bottom];
+    found = true;
+  }
+  SDL_AtomicUnlock(&own->lock);
+  
+  for (uint32_t i = 1; i < runner->worker_count && !found; i++) {
+    job_queue_t *victim = &runner->queues[(id + i) % runner->worker_count];
+    SDL_AtomicLock(&victim->lock);
+    if (victim->top < victim->bottom) {
+      *job = victim->jobs[victim->top++];
+      found = true;
+    }
+    SDL_AtomicUnlock(&victim->lock);
+  }
+  
+  return found;
+}
+
+static int runner_worker(void *data) {
+  worker_t *worker = (worker_t *) data;
+  runner_t *runner = worker->runner;
+  uint32_t index;
+  
+  while (runner_next_job(runner, worker->id, &index)) {
+    job_t *job = &runner->jobs[index];
+    config_t config = *runner->config; // engine_init may fall back to another engine
+    chip8_t chip8 = {0};
+    
+    job->ok = chip8_init(&chip8, job->rom_name) && engine_init(&chip8, &config);
+    if (job->ok) {
+      chip8_seed(&chip8, config.seed + job->instance);
+      job->stats = headless_run(&chip8, &config, NULL);
+      job->state_hash = state_hash(&chip8);
+      job->display_hash = display_hash(&chip8);
+    }
+    chip8_finish(&chip8);
+  }
+  
+  return 0;
+}
+
+// runs every ROM repeat times across a pool of worker threads and prints one line per machine plus totals
+static bool run_parallel(const config_t *config) {
+  // every ROM times repeat can overflow the job indices, which are 32 bit
+  const uint64_t total_jobs = (uint64_t) config->rom_count * config->repeat;
+  if (total_jobs > UINT32_MAX) {
+    SDL_Log("Too many instances, %u ROMs times %u repeats is over %u\n", config->rom_count, config->repeat, UINT32_MAX);
+    return false;
+  }
+  const uint32_t job_count = (uint32_t) total_jobs;
+  uint32_t worker_count = config->jobs ? config->jobs : (uint32_t) SDL_GetCPUCount();
+  if (worker_count > job_count) worker_count = job_count;
+  if (worker_count == 0) worker_count = 1;
+  
+  runner_t runner = {
+    .config = config,
+    .jobs = calloc(job_count, sizeof(job_t)),
+    .queues = calloc(worker_count, sizeof(job_queue_t)),
+    .worker_count = worker_count
+  };
+  uint32_t *queue_storage = calloc(job_count, sizeof(uint32_t));
+  worker_t *workers = calloc(worker_count, sizeof(worker_t));
+  SDL_Thread **threads = calloc(worker_count, sizeof(SDL_Thread *));
+  if (!runner.jobs || !runner.queues || !queue_storage || !workers || !threads) {
+    SDL_Log("Unable to allocate parallel runner\n");
+    return false;
+  }
+  
+  // deal jobs out in contiguous slices, stealing evens out ROMs that run for different lengths
+  for (uint32_t i = 0; i < job_count; i++) {
+    runner.jobs[i] = (job_t) {.rom_name = config->roms[i / config->repeat], .instance = i % config->repeat};
+    queue_storage[i] = i;
+  }
+  for (uint32_t w = 0; w < worker_count; w++) {
+    runner.queues[w].jobs = queue_storage;
+    runner.queues[w].top = (uint64_t) job_count * w / worker_count;
+    runner.queues[w].bottom = (uint64_t) job_count * (w + 1) / worker_count;
+  }
+  
+  const uint64_t start = SDL_GetPerformanceCounter();
+  for (uint32_t w = 0; w < worker_count; w++) {
+    workers[w] = (worker_t) {.runner = &runner, .id = w};
+    threads[w] = SDL_CreateThread(runner_worker, "chip8 worker", &workers[w]);
+    if (threads[w] == NULL) {
+      // whatever this worker would have run gets stolen by the others, or by us below
+      SDL_Log("Unable to create worker thread: %s\n", SDL_GetError());
+    }
+  }
+  for (uint32_t w = 0; w < worker_count; w++) {
+    if (threads[w])
+      SDL_WaitThread(threads[w], NULL);
+  }
+  runner_worker(&workers[0]); // picks up anything left if thread creation failed
+  const double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+  
+  uint64_t total_cycles = 0;
+  uint32_t failed = 0;
+  for (uint32_t i = 0; i < job_count; i++) {
+    const job_t *job = &runner.jobs[i];
+    if (!job->ok) {
+      printf("rom=%s instance=%u failed\n", job->rom_name, job->instance);
+      failed++;
+      continue;
+    }
+    printf("rom=%s instance=%u cycles=%llu frames=%llu state_hash=0x%016llX display_hash=0x%016llX\n",
+           job->rom_name, job->instance, (unsigned long long) job->stats.cycles,
+           (unsigned long long) job->stats.frames, (unsigned long long) job->state_hash,
+           (unsigned long long) job->display_hash);
+    total_cycles += job->stats.cycles;
+  }
+  printf("seed=%u instances=%u failed=%u workers=%u cycles=%llu seconds=%.3f ips=%.0f\n",
+         config->seed, job_count, failed, worker_count, (unsigned long long) total_cycles, seconds,
+         seconds > 0 ? total_cycles / seconds : 0.0);
+  
+  free(threads);
+  free(workers);
+  free(queue_storage);
+  free(runner.queues);
+  free(runner.jobs);
+  return failed == 0;
+}
+
+#define BATCH_LANES 16 // one 128 bit vector of 8 bit registers, the SSE2/NEON width
+
+// GCC/Clang vector extensions, lowered to whatever SIMD instructions the target has
+typedef uint8_t lane_u8_t __attribute__((vector_size(BATCH_LANES)));
+typedef int8_t lane_mask8_t __attribute__((vector_size(BATCH_LANES)));
+typedef uint16_t lane_u16_t __attribute__((vector_size(2 * BATCH_LANES)));
+typedef int16_t lane_mask16_t __attribute__((vector_size(2 * BATCH_LANES)));
+typedef uint32_t lane_u32_t __attribute__((vector_size(4 * BATCH_LANES)));
+typedef int32_t lane_mask32_t __attribute__((vector_size(4 * BATCH_LANES)));
+
+// picks new where mask lanes are all ones and keeps old everywhere else
+#define LANE_BLEND(old, new, mask) (((old) & ~(mask)) | ((new) & (mask)))
+
+// true if any lane of mask is set, tested a word at a time
+static bool lane_any(const lane_mask8_t mask) {
+  uint64_t words[BATCH_LANES / 8];
+  memcpy(words, &mask, sizeof words);
+  uint64_t any = 0;
+  for (uint32_t w = 0; w < BATCH_LANES / 8; w++)
+    any |= words[w];
+  return any;
+}
+
+// Machines running the same ROM in lockstep, with registers stored as structure of arrays
+typedef struct {
+  lane_u8_t V[16];            // V[x][lane]
+  lane_u16_t I;
+  lane_u16_t PC;
+  lane_u8_t delay_timer;
+  lane_u8_t sound_timer;
+  chip8_t lanes[BATCH_LANES]; // ram, display, stack and rng per lane, only synced with the registers for scalar ops
+  uint32_t lane_count;
+  bool fetched[RAM_SIZE];     // ram bytes fetched as code, a store to one can make the lanes' code diverge
+  bool stored[RAM_SIZE];      // ram bytes some lane stored to, fetching one can find the lanes' code diverged
+  bool code_diverged;         // once set every lane's opcode is compared against the leader's
+  decoded_t decoded[RAM_SIZE]; // shared decode cache, only trusted while no lane has rewritten its code
+} batch_t;
+
+// copies the lane registers out of the vectors into the lane's own chip8_t
+static void batch_load_lane(batch_t *batch, const uint32_t lane) {
+  chip8_t *chip8 = &batch->lanes[lane];
+  for (int x = 0; x <= 0xF; x++)
+    chip8->V[x] = batch->V[x][lane];
+  chip8->I = batch->I[lane];
+  chip8->PC = batch->PC[lane];
+  chip8->delay_timer = batch->delay_timer[lane];
+  chip8->sound_timer = batch->sound_timer[lane];
+}
+
+// copies the lane's chip8_t registers back into the vectors
+static void batch_store_lane(batch_t *batch, const uint32_t lane) {
+  const chip8_t *chip8 = &batch->lanes[lane];
+  for (int x = 0; x <= 0xF; x++)
+    batch->V[x][lane] = chip8->V[x];
+  batch->I[lane] = chip8->I;
+  batch->PC[lane] = chip8->PC;
+  batch->delay_timer[lane] = chip8->delay_timer;
+  batch->sound_timer[lane] = chip8->sound_timer;
+}
+
+// executes one instruction for every lane selected by mask. ALU ops, timers, I and
+// branches run across all lanes at once, anything touching ram, display or the stack runs per lane
+static void batch_execute(batch_t *batch, const lane_u8_t m8, const instruction_t *inst, const op_handler_t handler) {
+  const lane_u16_t m16 = (lane_u16_t) __builtin_convertvector((lane_mask8_t) m8, lane_mask16_t);
+  lane_u8_t *vx = &batch->V[inst->X];
+  lane_u8_t *vy = &batch->V[inst->Y];
+  lane_u8_t *vf = &batch->V[0xF];
+  lane_u8_t flag, cond;
+  
+  batch->PC += m16 & 2;
+  
+  // flags are written before results, exactly like the handlers, so VF as X or Y behaves the same
+  if (handler == op_6XNN) {
+    *vx = LANE_BLEND(*vx, inst->NN, m8);
+  } else if (handler == op_7XNN) {
+    *vx += inst->NN & m8;
+  } else if (handler == op_8XY0) {
+    *vx = LANE_BLEND(*vx, *vy, m8);
+  } else if (handler == op_8XY1) {
+    *vx = LANE_BLEND(*vx, *vx | *vy, m8);
+  } else if (handler == op_8XY2) {
+    *vx = LANE_BLEND(*vx, *vx & *vy, m8);
+  } else if (handler == op_8XY3) {
+    *vx = LANE_BLEND(*vx, *vx ^ *vy, m8);
+  } else if (handler == op_8XY4) {
+    flag = (lane_u8_t) ((lane_u8_t) (*vx + *vy) < *vx) & 1;
+    *vf = LANE_BLEND(*vf, flag, m8);
+    *vx = LANE_BLEND(*vx, *vx + *vy, m8);
+  } else if (handler == op_8XY5) {
+    flag = (lane_u8_t) (*vx >= *vy) & 1;
+    *vf = LANE_BLEND(*vf, flag, m8);
+    *vx = LANE_BLEND(*vx, *vx - *vy, m8);
+  } else if (handler == op_8XY7) {
+    flag = (lane_u8_t) (*vy >= *vx) & 1;
+    *vf = LANE_BLEND(*vf, flag, m8);
+    *vx = LANE_BLEND(*vx, *vy - *vx, m8);
+  } else if (handler == op_8XY6) {
+    *vf = LANE_BLEND(*vf, *vx & 1, m8);
+    *vx = LANE_BLEND(*vx, *vx >> 1, m8);
+  } else if (handler == op_8XYE) {
+    *vf = LANE_BLEND(*vf, *vx >> 7, m8);
+    *vx = LANE_BLEND(*vx, *vx << 1, m8);
+  } else if (handler == op_ANNN) {
+    batch->I = LANE_BLEND(batch->I, inst->NNN, m16);
+  } else if (handler == op_FX1E) {
+    batch->I = LANE_BLEND(batch->I, batch->I + __builtin_convertvector(*vx, lane_u16_t), m16);
+  } else if (handler == op_FX29) {
+    batch->I = LANE_BLEND(batch->I, __builtin_convertvector(*vx & 0xF, lane_u16_t) * 5, m16);
+  } else if (handler == op_FX07) {
+    *vx = LANE_BLEND(*vx, batch->delay_timer, m8);
+  } else if (handler == op_FX15) {
+    batch->delay_timer = LANE_BLEND(batch->delay_timer, *vx, m8);
+  } else if (handler == op_FX18) {
+    batch->sound_timer = LANE_BLEND(batch->sound_timer, *vx, m8);
+  } else if (handler == op_1NNN) {
+    batch->PC = LANE_BLEND(batch->PC, inst->NNN, m16);
+  } else if (handler == op_3XNN || handler == op_4XNN || handler == op_5XY0 || handler == op_9XY0) {
+    const lane_u8_t rhs = (handler == op_3XNN || handler == op_4XNN) ? (lane_u8_t) {0} + inst->NN : *vy;
+    cond = (lane_u8_t) (*vx == rhs);
+    if (handler == op_4XNN || handler == op_9XY0) cond = ~cond;
+    batch->PC += (lane_u16_t) __builtin_convertvector((lane_mask8_t) (cond & m8), lane_mask16_t) & 2;
+  } else if (handler == op_2NNN || handler == op_00EE || handler == op_CXNN || handler == op_DXYN) {
+    // common scalar ops only sync the registers they actually use
+    for (uint32_t lane = 0; lane < batch->lane_count; lane++) {
+      if (!m8[lane]) continue;
+      
+      chip8_t *chip8 = &batch->lanes[lane];
+      chip8->PC = batch->PC[lane];
+      if (handler == op_DXYN) {
+        chip8->V[inst->X] = batch->V[inst->X][lane];
+        chip8->V[inst->Y] = batch->V[inst->Y][lane];
+        chip8->I = batch->I[lane];
+      }
+      handler(chip8, inst);
+      batch->PC[lane] = chip8->PC;
+      if (handler == op_CXNN) batch->V[inst->X][lane] = chip8->V[inst->X];
+      if (handler == op_DXYN) batch->V[0xF][lane] = chip8->V[0xF];
+    }
+  } else {
+    for (uint32_t lane = 0; lane < batch->lane_count; lane++) {
+      if (!m8[lane]) continue;
+      
+      chip8_t *chip8 = &batch->lanes[lane];
+      batch_load_lane(batch, lane);
+      const uint16_t store_address = chip8->I;
+      handler(chip8, inst);
+      batch_store_lane(batch, lane);
+      
+      // stores into fetched code mean lanes may no longer agree on the opcode at a PC, FX55 in any quirk variant.
+      // Stored bytes are remembered too, since lanes that stored different values there only disagree once it runs
+      if (handler == op_FX33 || handler == op_5XY2 || (inst->opcode & 0xF0FF) == 0xF055) {
+        const uint32_t length = handler == op_FX33 ? 3 : handler == op_5XY2 ? abs(inst->Y - inst->X) + 1u : inst->X + 1u;
+        for (uint32_t i = 0; i < length; i++) {
+          const uint32_t a = (store_address + i) & RAM_MASK;
+          batch->code_diverged |= batch->fetched[a];
+          batch->stored[a] = true;
+        }
+      }
+    }
+  }
+}
+
+// runs count instructions on every lane. Each step the lane furthest behind leads, and every
+// lane sitting at the same PC with the same opcode executes alongside it
+static void batch_run_burst(batch_t *batch, const uint32_t count) {
+  lane_u32_t done;
+  for (uint32_t lane = 0; lane < BATCH_LANES; lane++)
+    done[lane] = lane < batch->lane_count ? 0 : count;
+  
+  // while every unfinished lane runs each step they all advance together and the leader stays the
+  // furthest behind, it's only looked for again once some lane was left out
+  uint32_t leader = 0;
+  bool split = true;
+  for (;;) {
+    const lane_mask8_t live = __builtin_convertvector((lane_mask32_t) (done < count), lane_mask8_t);
+    if (!lane_any(live)) break;
+    
+    if (split) {
+      uint32_t least = count;
+      for (uint32_t lane = 0; lane < batch->lane_count; lane++) {
+        if (done[lane] < least) {
+          least = done[lane];
+          leader = lane;
+        }
+      }
+    }
+    
+    const uint16_t pc = batch->PC[leader];
+    const uint16_t address = pc;
+    const uint8_t *ram = batch->lanes[leader].ram;
+    decoded_t *entry = &batch->decoded[address];
+    decoded_t fresh;
+    
+    // code some lane wrote before it first ran may already differ between the lanes
+    if (!batch->code_diverged && !entry->handler && (batch->stored[address] || batch->stored[(address + 1) & RAM_MASK]))
+      batch->code_diverged = true;
+    
+    if (batch->code_diverged) {
+      fresh.inst = decode_instruction((ram[address] << 8) | ram[(address + 1) & RAM_MASK]);
+      fresh.handler = decode_handler(&fresh.inst, batch->lanes[leader].quirk_profile);
+      entry = &fresh;
+    } else if (!entry->handler) {
+      entry->inst = decode_instruction((ram[address] << 8) | ram[(address + 1) & RAM_MASK]);
+      entry->handler = decode_handler(&entry->inst, batch->lanes[leader].quirk_profile);
+      batch->fetched[address] = batch->fetched[(address + 1) & RAM_MASK] = true;
+    }
+    
+    // lanes that diverged to another PC simply wait until they lead or regroup. Only once some lane
+    // rewrote its code does each lane's opcode have to be checked one by one
+    lane_u8_t m8 = (lane_u8_t) (__builtin_convertvector((lane_mask16_t) (batch->PC == pc), lane_mask8_t) & live);
+    if (batch->code_diverged) {
+      for (uint32_t lane = 0; lane < batch->lane_count; lane++) {
+        const uint8_t *lane_ram = batch->lanes[lane].ram;
+        if (m8[lane] && ((lane_ram[address] << 8) | lane_ram[(address + 1) & RAM_MASK]) != entry->inst.opcode)
+          m8[lane] = 0;
+      }
+    }
     
-    case 0xC: // 0xCXNN - set VX to NN & <a random int 0-255>
-      chip8->V[chip8->inst.X] = (uint8_t) (chip8->inst.NN & SDL_GetTicks());
-      break;
+    batch_execute(batch, m8, &entry->inst, entry->handler);
     
-    case 0xD: { // 0xDXYN - draw N rows starting at (VX, VY) from memory location I
-      uint8_t x = chip8->V[chip8->inst.X] % config.window_width;
-      uint8_t y = chip8->V[chip8->inst.Y] % config.window_height;
-      const uint8_t x0 = x; // for resetting x value before inner loop
+    done += __builtin_convertvector((lane_mask8_t) m8, lane_u32_t) & 1;
+    split = lane_any((lane_mask8_t) m8 != live);
+  }
+}
+
+// runs every ROM repeat times in lockstep batches of up to BATCH_LANES instances, printing the same
+// per instance lines as run_parallel so results can be checked against the scalar engines
+static bool run_batches(const config_t *config) {
+  batch_t *batch = malloc(sizeof(batch_t));
+  if (batch == NULL) {
+    SDL_Log("Unable to allocate batch\n");
+    return false;
+  }
+  
+  uint64_t total_cycles = 0;
+  uint32_t instances = 0, failed = 0;
+  const uint64_t start = SDL_GetPerformanceCounter();
+  
+  for (uint32_t rom = 0; rom < config->rom_count; rom++) {
+    for (uint32_t first = 0; first < config->repeat; first += BATCH_LANES) {
+      memset(batch, 0, sizeof(batch_t));
+      batch->lane_count = config->repeat - first < BATCH_LANES ? config->repeat - first : BATCH_LANES;
+      instances += batch->lane_count;
       
-      chip8->V[0xF] = 0; // carry flag initialized to 0
-      for (uint16_t i = 0; i < chip8->inst.N; i++) {
-        const uint8_t sprite_data = chip8->ram[chip8->I + i];
-        x = x0; // reset x to beginning of row
+      bool ok = true;
+      for (uint32_t lane = 0; lane < batch->lane_count && ok; lane++) {
+        ok = chip8_init(&batch->lanes[lane], config->roms[rom]);
+        batch->lanes[lane].quirk_profile = config->quirk_profile < 0 ? QUIRKS_DEFAULT : config->quirk_profile;
+        chip8_seed(&batch->lanes[lane], config->seed + first + lane);
+        batch_store_lane(batch, lane);
+      }
+      if (!ok) {
+        printf("rom=%s instance=%u-%u failed\n", config->roms[rom], first, first + batch->lane_count - 1);
+        failed += batch->lane_count;
+        for (uint32_t lane = 0; lane < batch->lane_count; lane++)
+          chip8_finish(&batch->lanes[lane]);
+        continue;
+      }
+      
+      cycle_budget_t budget = cycle_budget(config->clock_speed);
+      run_stats_t stats = {0};
+      while (!headless_interrupted) {
+        if (config->max_frames && stats.frames >= config->max_frames) break;
+        if (config->max_cycles && stats.cycles >= config->max_cycles) break;
         
-        for (int8_t j = 7; j >= 0; j--) {
-          bool *display_pixel = &chip8->display[y * config.window_width + x]; // current pixel state
-          const bool sprite_pixel = sprite_data & (1 << j); // sprite pixel state
-          if (*display_pixel && sprite_pixel)
-            chip8->V[0xF] = 1; // pixel "collision" means set carry flag
-          *display_pixel ^= sprite_pixel; // "collisions" unset the pixels
-          if (++x >= config.window_width) break; // stop drawing row if reached the right edge of window
-        }
-        if (++y >= config.window_height) break; // stop drawing sprite if reached the bottom edge of window
+        uint32_t burst = cycle_budget_next(&budget);
+        if (config->max_cycles && config->max_cycles - stats.cycles < burst)
+          burst = config->max_cycles - stats.cycles;
+        batch_run_burst(batch, burst);
+        stats.cycles += burst;
+        
+        // 60hz timer tick for every lane at once
+        batch->delay_timer -= (lane_u8_t) (batch->delay_timer != 0) & 1;
+        batch->sound_timer -= (lane_u8_t) (batch->sound_timer != 0) & 1;
+        stats.frames++;
+      }
+      
+      for (uint32_t lane = 0; lane < batch->lane_count; lane++) {
+        batch_load_lane(batch, lane);
+        printf("rom=%s instance=%u cycles=%llu frames=%llu state_hash=0x%016llX display_hash=0x%016llX\n",
+               config->roms[rom], first + lane, (unsigned long long) stats.cycles,
+               (unsigned long long) stats.frames, (unsigned long long) state_hash(&batch->lanes[lane]),
+               (unsigned long long) display_hash(&batch->lanes[lane]));
+        total_cycles += stats.cycles;
+        chip8_finish(&batch->lanes[lane]);
       }
-      break;
     }
+  }
+  
+  const double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+  printf("seed=%u instances=%u failed=%u lanes=%u cycles=%llu seconds=%.3f ips=%.0f\n",
+         config->seed, instances, failed, BATCH_LANES, (unsigned long long) total_cycles, seconds,
+         seconds > 0 ? total_cycles / seconds : 0.0);
+  
+  free(batch);
+  return failed == 0;
+}
+
+#ifdef SERVER_SUPPORTED
+#define SERVER_HEADER_SIZE 8      // frame number, delta length, flags and a reserved byte
+#define SERVER_FLAG_HIRES 1       // the delta is of a 128x64 display
+#define SERVER_FLAG_SOUND 2       // the sound timer is running, the client plays the tone
+#define SERVER_MESSAGE_MAX (SERVER_HEADER_SIZE + 5 * sizeof(((display_t *) 0)->rows))
+
+// One connected client. Besides the machine it only keeps the display as the client last got it,
+// a pending half of a keypad mask and whatever of a message the socket hasn't taken yet. The machine's
+// ram is a private mapping of the image every session starts from, so it only costs the pages it stores to
+typedef struct {
+  int fd;
+  chip8_t chip8;
+  cycle_budget_t budget;
+  uint8_t sent[sizeof(((display_t *) 0)->rows)]; // the display as the client has it, in wire byte order
+  uint8_t sent_flags;
+  bool key_pending;       // key_low holds the first byte of a mask whose second hasn't arrived
+  uint8_t key_low;
+  uint32_t frame;
+  uint8_t *backlog;       // NULL whenever the client is caught up, so idle sessions hold no buffer
+  uint32_t backlog_length;
+  uint32_t backlog_sent;
+  bool closing;           // dropped, freed once the events already returned with it are handled
+} server_session_t;
+
+static void server_close(server_session_t *session) {
+  close(session->fd);
+  munmap(session->chip8.ram, RAM_SIZE + RAM_SLACK);
+  session->chip8.ram = NULL;
+  chip8_finish(&session->chip8);
+  free(session->backlog);
+  free(session);
+}
+
+// writes as much of the backlog as the socket takes. False once the client is gone
+static bool server_flush(server_session_t *session) {
+  while (session->backlog) {
+    const ssize_t sent = send(session->fd, session->backlog + session->backlog_sent,
+                              session->backlog_length - session->backlog_sent, MSG_NOSIGNAL);
+    if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+    session->backlog_sent += sent;
+    if (session->backlog_sent == session->backlog_length) {
+      free(session->backlog);
+      session->backlog = NULL;
+    }
+  }
+  return true;
+}
+
+// sends the XOR of the display against what the client has, run length encoded by delta_encode, if
+// anything changed. While an earlier message is still queued nothing new is sent, the next delta
+// is against the last display that went out so it carries everything skipped meanwhile
+static bool server_send_frame(server_session_t *session, uint8_t *message) {
+  chip8_t *chip8 = &session->chip8;
+  const uint8_t flags = (chip8->display.hires ? SERVER_FLAG_HIRES : 0) | (chip8->sound_timer ? SERVER_FLAG_SOUND : 0);
+  if (session->backlog || (!chip8->dirty_rows && flags == session->sent_flags)) return true;
+  
+  // the rows go out as little endian words whatever the host's byte order
+  uint8_t display[sizeof session->sent];
+  const uint64_t *words = &chip8->display.rows[0][0][0];
+  for (uint32_t w = 0; w < sizeof display / 8; w++) {
+    for (uint32_t b = 0; b < 8; b++)
+      display[8 * w + b] = words[w] >> (8 * b) & 0xFF;
+  }
+  
+  const uint32_t length = delta_encode(display, session->sent, sizeof display, message + SERVER_HEADER_SIZE);
+  chip8->dirty_rows = 0;
+  if (!length && flags == session->sent_flags) return true;
+  
+  memcpy(session->sent, display, sizeof session->sent);
+  session->sent_flags = flags;
+  message[0] = session->frame & 0xFF;
+  message[1] = session->frame >> 8 & 0xFF;
+  message[2] = session->frame >> 16 & 0xFF;
+  message[3] = session->frame >> 24;
+  message[4] = length & 0xFF;
+  message[5] = length >> 8;
+  message[6] = flags;
+  message[7] = 0;
+  
+  const uint32_t total = SERVER_HEADER_SIZE + length;
+  ssize_t sent = send(session->fd, message, total, MSG_NOSIGNAL);
+  if (sent < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+    sent = 0;
+  }
+  if ((uint32_t) sent == total) return true;
+  
+  session->backlog = malloc(total - sent);
+  if (!session->backlog) return false;
+  memcpy(session->backlog, message + sent, total - sent);
+  session->backlog_length = total - sent;
+  session->backlog_sent = 0;
+  return true;
+}
+
+// applies keypad masks from the client, two bytes little endian each with bit n set while key n is down.
+// False once the client has hung up
+static bool server_receive(server_session_t *session) {
+  uint8_t bytes[64];
+  for (;;) {
+    const ssize_t count = recv(session->fd, bytes, sizeof bytes, 0);
+    if (count == 0) return false;
+    if (count < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
     
-    case 0xE:
-      switch (chip8->inst.NN) {
-        case 0x9E: // 0xEX9E - skip next instruction if key in VX is pressed
-          if (chip8->keypad[chip8->V[chip8->inst.X]])
-            chip8->PC += 2;
-          break;
-        
-        case 0xA1: // 0xEXA1 - skip next instruction if key in VX is not pressed
-          if (!chip8->keypad[chip8->V[chip8->inst.X]])
-            chip8->PC += 2;
-          break;
-        
-        default:
-          break;
+    for (ssize_t i = 0; i < count; i++) {
+      if (!session->key_pending) {
+        session->key_low = bytes[i];
+        session->key_pending = true;
+      } else {
+        session->chip8.keypad = session->key_low | bytes[i] << 8;
+        session->key_pending = false;
       }
-      break;
+    }
+  }
+}
+
+// opens a listening socket on the port, dual stack where IPv6 is available and IPv4 only where it isn't
+static int server_listen(const uint32_t port) {
+  const int off = 0, on = 1;
+  int listener = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  struct sockaddr_in6 address6 = {.sin6_family = AF_INET6, .sin6_port = htons(port), .sin6_addr = in6addr_any};
+  if (listener >= 0 && setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) == 0 &&
+      setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off) == 0 &&
+      bind(listener, (struct sockaddr *) &address6, sizeof address6) == 0 && listen(listener, 128) == 0)
+    return listener;
+  if (listener >= 0) close(listener);
+  
+  listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+  if (listener >= 0 && setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) == 0 &&
+      bind(listener, (struct sockaddr *) &address, sizeof address) == 0 && listen(listener, 128) == 0)
+    return listener;
+  if (listener >= 0) close(listener);
+  return -1;
+}
+
+// writes the memory image every session starts from into an unlinked shared memory object, which
+// sessions map copy on write. Returns its descriptor, or -1 when it couldn't be made
+static int server_image(const chip8_t *chip8, const uint32_t port) {
+  char name[64];
+  snprintf(name, sizeof name, "/chip8-serve-%ld-%u", (long) getpid(), port);
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) return -1;
+  shm_unlink(name);
+  
+  const size_t size = RAM_SIZE + RAM_SLACK;
+  if (ftruncate(fd, size) != 0 || pwrite(fd, chip8->ram, size, 0) != (ssize_t) size) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Serves the ROM to every client that connects on the port, each with a machine of its own. One
+// thread runs them all from an epoll loop: a 60hz timer runs a frame on every machine and sends
+// the display changes, and sockets bring in keypad masks. Clients get, per changed frame, a little
+// endian header of the 32 bit frame number, 16 bit delta length, flags and a zero byte, then the
+// delta. Applying it with XOR to an all zero display_t::rows, kept as little endian words, rebuilds it.
+// Keypad masks from clients are little endian too, they are put together byte by byte.
+// Sessions always run on the switch engine, whose machines hold no caches, so each one is a few KB
+static bool run_server(const config_t *config, const library_t *library) {
+  const library_entry_t *entry = library ? &library->entries[library->current] : NULL;
+  mapped_file_t rom = {0};
+  if (entry) {
+    rom = (mapped_file_t) {.data = library->file.data + entry->offset, .size = entry->size};
+  } else if (!map_file(config->roms[0], &rom)) {
+    SDL_Log("Unable to open ROM file: %s\n", config->roms[0]);
+    return false;
+  }
+  const char *rom_name = entry ? entry->name : config->roms[0];
+  
+  if (config->engine != ENGINE_SWITCH || config->precompile)
+    SDL_Log("Sessions run on the switch engine, --engine and --precompile don't apply to a server\n");
+  config_t server_config = *config;
+  server_config.engine = ENGINE_SWITCH;
+  
+  // every session starts as a copy on write mapping of the same machine, the rest of it is copied
+  chip8_t image;
+  if (!chip8_load(&image, rom_name, rom.data, rom.size) || !engine_init(&image, &server_config)) {
+    chip8_finish(&image);
+    if (!entry) unmap_file(&rom);
+    return false;
+  }
+  if (entry) image.quirk_profile = library_quirks(entry, config);
+  const int image_fd = server_image(&image, config->serve_port);
+  
+  const int listener = server_listen(config->serve_port);
+  const int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  const int poller = epoll_create1(0);
+  const int on = 1;
+  const struct itimerspec period = {
+    .it_interval = {.tv_nsec = 1000000000 / FRAME_RATE},
+    .it_value = {.tv_nsec = 1000000000 / FRAME_RATE},
+  };
+  
+  // the listener and the timer are told apart from sessions by their own addresses as event data
+  struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = (void *) &listener};
+  struct epoll_event timer_event = {.events = EPOLLIN, .data.ptr = (void *) &timer};
+  bool ok = image_fd >= 0 && listener >= 0 && timer >= 0 && poller >= 0 &&
+            timerfd_settime(timer, 0, &period, NULL) == 0 &&
+            epoll_ctl(poller, EPOLL_CTL_ADD, listener, &listen_event) == 0 &&
+            epoll_ctl(poller, EPOLL_CTL_ADD, timer, &timer_event) == 0;
+  
+  server_session_t **sessions = calloc(config->max_sessions, sizeof(server_session_t *));
+  server_session_t **closing = calloc(config->max_sessions, sizeof(server_session_t *));
+  uint8_t *message = malloc(SERVER_MESSAGE_MAX);
+  if (!ok || !sessions || !closing || !message) {
+    SDL_Log("Unable to serve on port %u: %s\n", config->serve_port, strerror(errno));
+    ok = false;
+  } else {
+    SDL_Log("Serving %s on port %u\n", rom_name, config->serve_port);
+  }
+  
+  uint32_t session_count = 0;
+  uint32_t closing_count = 0;
+  uint64_t served = 0;
+  bool accepting = true;  // off while out of file descriptors, the level triggered listener would spin
+  bool starved = false;   // accepting has failed since the last client got in, so it's only logged once
+  while (ok && !headless_interrupted) {
+    struct epoll_event events[64];
+    const int ready = epoll_wait(poller, events, 64, -1);
+    if (ready < 0 && errno != EINTR) {
+      SDL_Log("Server event loop failed: %s\n", strerror(errno));
+      ok = false;
+    }
     
-    case 0xF:
-      switch (chip8->inst.NN) {
-        case 0x07: // 0xFX07 - set VX to the value of the delay timer
-          chip8->V[chip8->inst.X] = chip8->delay_timer;
-          break;
-        
-        case 0x0A: { // 0xFX0A - await a key press, then store it in VX
-          bool waiting = true;
-          for (int i = 0; i <= 0xF; i++) {
-            if (chip8->keypad[i]) {
-              chip8->V[chip8->inst.X] = i;
-              waiting = false;
-              break;
-            }
+    for (int e = 0; e < ready; e++) {
+      if (events[e].data.ptr == &listener) {
+        int fd;
+        while ((fd = accept(listener, NULL, NULL)) >= 0) {
+          fcntl(fd, F_SETFL, O_NONBLOCK);
+          starved = false;
+          server_session_t *session = session_count < config->max_sessions ? calloc(1, sizeof(server_session_t)) : NULL;
+          uint8_t *ram = session ? mmap(NULL, RAM_SIZE + RAM_SLACK, PROT_READ | PROT_WRITE, MAP_PRIVATE, image_fd, 0)
+                                 : MAP_FAILED;
+          if (ram == MAP_FAILED) {
+            free(session);
+            close(fd);
+            continue;
           }
           
-          // this is a way to continuously run this instruction while still allowing the timers to decrement properly
-          if (waiting)
-            chip8->PC -= 2;
-          
-          break;
+          session->chip8 = image;
+          session->chip8.ram = ram;
+          chip8_seed(&session->chip8, config->seed + (uint32_t) served++);
+          session->fd = fd;
+          session->budget = cycle_budget(config->clock_speed);
+          session->sent_flags = UINT8_MAX;  // the first frame always goes out
+          setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+          struct epoll_event event = {.events = EPOLLIN, .data.ptr = session};
+          if (epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event) != 0) {
+            server_close(session);
+            continue;
+          }
+          sessions[session_count++] = session;
         }
         
-        case 0x15: // 0xFX15 - set delay timer to VX
-          chip8->delay_timer = chip8->V[chip8->inst.X];
-          break;
+        // retried on the next frame, by when sessions may have closed and freed some descriptors
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+          if (!starved) SDL_Log("Unable to accept a client: %s\n", strerror(errno));
+          starved = true;
+          struct epoll_event event = {.events = 0, .data.ptr = (void *) &listener};
+          epoll_ctl(poller, EPOLL_CTL_MOD, listener, &event);
+          accepting = false;
+        }
+        continue;
+      }
+      
+      if (events[e].data.ptr == &timer) {
+        // like the windowed scheduler, frames further behind than MAX_CATCHUP_FRAMES are dropped
+        uint64_t due = 0;
+        if (read(timer, &due, sizeof due) != sizeof due) continue;
+        if (due > MAX_CATCHUP_FRAMES) due = MAX_CATCHUP_FRAMES;
         
-        case 0x18: // 0xFX18 - set sound timer to VX
-          chip8->sound_timer = chip8->V[chip8->inst.X];
-          break;
+        if (!accepting) {
+          epoll_ctl(poller, EPOLL_CTL_MOD, listener, &listen_event);
+          accepting = true;
+        }
         
-        case 0x1E: // 0xFX1E - add VX to I
-          chip8->I += chip8->V[chip8->inst.X];
-          break;
+        for (uint32_t s = 0; s < session_count; ) {
+          server_session_t *session = sessions[s];
+          for (uint64_t f = 0; f < due; f++) {
+            run_burst(&session->chip8, &server_config, cycle_budget_next(&session->budget));
+            update_timers(&session->chip8);
+            session->frame++;
+          }
           
-        case 0x29: // 0xFX29 - set I to the memory location of the sprite in VX
-          chip8->I = 5 * (chip8->V[chip8->inst.X] & 0xF);
-          break;
-        
-        case 0x33: { // 0xFX33 - store hundreds/tens/ones place of binary coded decimal value of VX in memory at I/I+1/I+2
-          uint8_t value = chip8->V[chip8->inst.X];
-          uint8_t ones, tens, hundreds;
-          ones = value % 10;
-          value /= 10;
-          tens = value % 10;
-          hundreds = value / 10;
-          chip8->ram[chip8->I] = hundreds;
-          chip8->ram[chip8->I + 1] = tens;
-          chip8->ram[chip8->I + 2] = ones;
-          break;
+          const bool queued = session->backlog != NULL;
+          if (!server_send_frame(session, message)) {
+            session->closing = true;
+            closing[closing_count++] = session;
+            sessions[s] = sessions[--session_count];
+            continue;
+          }
+          if (!queued && session->backlog) {
+            struct epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data.ptr = session};
+            epoll_ctl(poller, EPOLL_CTL_MOD, session->fd, &event);
+          }
+          s++;
         }
-        
-        case 0x55: // 0xFX55 - store from V0 to VX inclusive in memory starting at I
-          for (int offset = 0; offset <= chip8->inst.X; offset++)
-            chip8->ram[chip8->I + offset] = chip8->V[offset];
-          break;
-        
-        case 0x65: // 0xFX65 - load from V0 to VX inclusive from memory starting at I
-          for (int offset = 0; offset <= chip8->inst.X; offset++)
-            chip8->V[offset] = chip8->ram[chip8->I + offset];
-          break;
-        
-        default:
-          break;
+        continue;
       }
-      break;
+      
+      server_session_t *session = events[e].data.ptr;
+      if (session->closing) continue;
+      bool alive = !(events[e].events & (EPOLLERR | EPOLLHUP));
+      if (alive && (events[e].events & EPOLLIN)) alive = server_receive(session);
+      if (alive && (events[e].events & EPOLLOUT)) {
+        alive = server_flush(session);
+        if (alive && !session->backlog) {
+          struct epoll_event event = {.events = EPOLLIN, .data.ptr = session};
+          epoll_ctl(poller, EPOLL_CTL_MOD, session->fd, &event);
+        }
+      }
+      if (!alive) {
+        for (uint32_t s = 0; s < session_count; s++) {
+          if (sessions[s] == session) {
+            sessions[s] = sessions[--session_count];
+            break;
+          }
+        }
+        session->closing = true;
+        closing[closing_count++] = session;
+      }
+    }
     
-    default:
-      break;
+    // a closed fd leaves the epoll set on its own
+    for (uint32_t s = 0; s < closing_count; s++)
+      server_close(closing[s]);
+    closing_count = 0;
   }
+  
+  SDL_Log("Served %llu sessions\n", (unsigned long long) served);
+  for (uint32_t s = 0; s < session_count; s++)
+    server_close(sessions[s]);
+  free(sessions);
+  free(closing);
+  free(message);
+  chip8_finish(&image);
+  if (image_fd >= 0) close(image_fd);
+  if (poller >= 0) close(poller);
+  if (timer >= 0) close(timer);
+  if (listener >= 0) close(listener);
+  if (!entry) unmap_file(&rom);
+  return ok;
+}
+#else
+static bool run_server(const config_t *config, const library_t *library) {
+  (void) config;
+  (void) library;
+  SDL_Log("Server mode is not supported on this host\n");
+  return false;
 }
+#endif
 
-void sdl_finish(const sdl_t sdl) {
-  SDL_DestroyRenderer(sdl.renderer);
-  SDL_DestroyWindow(sdl.window);
-  SDL_CloseAudioDevice(sdl.device);
-  SDL_Quit();  // ends all running sdl subsystems
+// Synthetic program for --bench, an endless loop of one class of instruction closed by a jump back to
+// its start. Setup words before the loop run once. The jump stream is the loop overhead the others are
+// measured against
+typedef struct {
+  const char *name;
+  uint16_t code[16];
+  uint32_t length;
+  uint32_t per_loop;  // instructions one pass of the loop runs, its closing jump included
+} bench_stream_t;
+
+static const bench_stream_t bench_streams[] = {
+  // two jumps to each other, a jump to itself would be skipped as an idle loop
+  {"jump", {0x1202, 0x1200}, 2, 2},
+  // arithmetic and logic on registers only
+  {"alu", {0x6001, 0x6103, 0x6207, 0x630F, 0x8014, 0x8135, 0x8231, 0x8322, 0x8413, 0x8216, 0x830E, 0x7001,
+           0x7203, 0x8044, 0x8150, 0x1208}, 16, 12},
+  // conditional skips with V0 = 0, V1 = 1 and no key down, none of them taken so every word runs
+  {"skip", {0x6000, 0x6101, 0x3001, 0x4000, 0x5010, 0x9000, 0x3100, 0x4101, 0x9110, 0xE09E, 0x3002, 0x4000,
+            0x1204}, 13, 11},
+  // sprite draws of varying heights at an aligned and an unaligned column
+  {"draw", {0xA000, 0x6000, 0x6107, 0xD015, 0xD01F, 0xD105, 0xD10A, 0xD015, 0xD01F, 0xD105, 0xD10A, 0x1206},
+   12, 9},
+  // delay and sound timer loads and reads
+  {"timer", {0x6005, 0x6203, 0xF015, 0xF107, 0xF218, 0xF307, 0xF015, 0xF107, 0xF218, 0xF307, 0x1204}, 11, 9},
+  // I loads, register file stores and loads and BCD to a data area
+  {"memory", {0xA800, 0xF755, 0xF365, 0xF333, 0xAA00, 0xF755, 0xF765, 0xF333, 0x1200}, 9, 9},
+  // nested calls and returns
+  {"call", {0x2206, 0x2206, 0x1200, 0x220A, 0x00EE, 0x00EE}, 6, 9},
+};
+
+static void print_json_string(const char *text) {
+  putchar('"');
+  for (; *text; text++) {
+    if (*text == '"' || *text == '\\')
+      printf("\\%c", *text);
+    else if ((unsigned char) *text < 0x20)
+      printf("\\u%04x", *text);
+    else
+      putchar(*text);
+  }
+  putchar('"');
 }
 
-bool clear_screen(const sdl_t sdl, const config_t config) {
-  // sets draw color to config background color
-  // consider changing the struct to just use a bit field?
-  const uint8_t r = config.background_color >> 24 & 0xFF;
-  const uint8_t g = config.background_color >> 16 & 0xFF;
-  const uint8_t b = config.background_color >> 8 & 0xFF;
-  const uint8_t a = config.background_color & 0xFF;
+// runs one machine to config->max_cycles on one engine and prints the result as a JSON object, left open
+// for the caller's own fields. Returns false if the engine isn't available on this host
+static bool bench_run(const config_t *config, const char *name, const uint8_t *rom, const size_t size,
+               const engine_t engine, const bool first, run_stats_t *stats, double *seconds) {
+  config_t run_config = *config;
+  run_config.engine = engine;
   
-  if (SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a) != 0) {
-    SDL_Log("Unable to set renderer draw color: %s\n", SDL_GetError());
+  chip8_t chip8;
+  if (!chip8_load(&chip8, name, rom, size))
     return false;
-  }
-  
-  // draws a blank background
-  if (SDL_RenderClear(sdl.renderer) != 0) {
-    SDL_Log("Error clearing background: %s\n", SDL_GetError());
+  if (!engine_init(&chip8, &run_config) || run_config.engine != engine) {
+    chip8_finish(&chip8);
     return false;
   }
+  chip8_seed(&chip8, config->seed);
+  
+  const uint64_t start = SDL_GetPerformanceCounter();
+  *stats = headless_run(&chip8, &run_config, NULL);
+  *seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+  chip8_finish(&chip8);
   
+  printf("%s\n    {\"name\": ", first ? "" : ",");
+  print_json_string(name);
+  printf(", \"engine\": \"%s\", \"instructions\": %llu, \"frames\": %llu, \"seconds\": %.6f, \"ips\": %.0f",
+         engine_names[engine], (unsigned long long) stats->cycles, (unsigned long long) stats->frames, *seconds,
+         *seconds > 0 ? stats->cycles / *seconds : 0.0);
   return true;
 }
 
-void update_screen(const sdl_t sdl, config_t config, chip8_t chip8) {
-  SDL_Rect _rect = {0, 0, config.scale_factor, config.scale_factor};
-  SDL_Rect *rect = &_rect;
+// runs every synthetic stream and every corpus ROM through every engine, then times framebuffer
+// expansion, and prints it all as one JSON document
+static bool run_bench(config_t *config) {
+  if (!config->max_cycles)
+    config->max_cycles = 10000000;
   
-  // prepare foreground color values
-  const uint8_t fg_r = config.foreground_color >> 24 & 0xFF;
-  const uint8_t fg_g = config.foreground_color >> 16 & 0xFF;
-  const uint8_t fg_b = config.foreground_color >> 8 & 0xFF;
-  const uint8_t fg_a = config.foreground_color & 0xFF;
-  
-  // prepare background color values
-  const uint8_t bg_r = config.background_color >> 24 & 0xFF;
-  const uint8_t bg_g = config.background_color >> 16 & 0xFF;
-  const uint8_t bg_b = config.background_color >> 8 & 0xFF;
-  const uint8_t bg_a = config.background_color & 0xFF;
+  printf("{\n  \"cycles\": %llu,\n  \"clock_speed\": %u,\n  \"seed\": %u,\n  \"classes\": [",
+         (unsigned long long) config->max_cycles, config->clock_speed, config->seed);
+  bool first = true;
+  double jump_ns[sizeof engine_names / sizeof engine_names[0]] = {0};
+  for (uint32_t s = 0; s < sizeof bench_streams / sizeof bench_streams[0]; s++) {
+    const bench_stream_t *stream = &bench_streams[s];
+    uint8_t rom[2 * 16];
+    for (uint32_t i = 0; i < stream->length; i++) {
+      rom[2 * i] = stream->code[i] >> 8;
+      rom[2 * i + 1] = stream->code[i] & 0xFF;
+    }
+    for (uint32_t e = 0; e < sizeof engine_names / sizeof engine_names[0]; e++) {
+      run_stats_t stats;
+      double seconds;
+      if (!bench_run(config, stream->name, rom, 2 * stream->length, e, first, &stats, &seconds))
+        continue;
+      first = false;
+      
+      // the first stream is all jumps and sets the loop overhead, the others take one jump per pass off
+      const uint64_t jumps = s ? stats.cycles / stream->per_loop : 0;
+      const uint64_t class_instructions = stats.cycles - jumps;
+      double ns = class_instructions ? (seconds * 1e9 - jumps * jump_ns[e]) / class_instructions : 0.0;
+      if (ns < 0) ns = 0;
+      if (!s) jump_ns[e] = ns;
+      printf(", \"class_instructions\": %llu, \"ns_per_class_instruction\": %.3f}",
+             (unsigned long long) class_instructions, ns);
+    }
+  }
   
-  // loop through display and render the above rectangle for each enabled pixel
-  for (uint32_t index = 0; index < sizeof(chip8.display); index++) {
-    // translate index to 2d coordinates
-    rect->x = (index % config.window_width) * config.scale_factor;
-    rect->y = (index / config.window_width) * config.scale_factor;
+  printf("\n  ],\n  \"roms\": [");
+  first = true;
+  bool ok = true;
+  for (uint32_t r = 0; r < config->rom_count; r++) {
+    // chip8_init reports the reason, the ROM is left out of the results
+    chip8_t probe;
+    if (!chip8_init(&probe, config->roms[r])) {
+      ok = false;
+      continue;
+    }
     
-    if (chip8.display[index])
-      SDL_SetRenderDrawColor(sdl.renderer, fg_r, fg_g, fg_b, fg_a); // draw with foreground color
-    else
-      SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a); // draw with background color
-      
-    SDL_RenderFillRect(sdl.renderer, rect);
+    const size_t size = RAM_SIZE - 0x200;
+    for (uint32_t e = 0; e < sizeof engine_names / sizeof engine_names[0]; e++) {
+      run_stats_t stats;
+      double seconds;
+      if (!bench_run(config, config->roms[r], &probe.ram[0x200], size, e, first, &stats, &seconds))
+        continue;
+      first = false;
+      printf(", \"ns_per_instruction\": %.3f}", stats.cycles ? seconds * 1e9 / stats.cycles : 0.0);
+    }
+    chip8_finish(&probe);
+  }
+  
+  // CPU side of a full hires two plane texture frame, the part the renderer doesn't hand to the GPU. Texture
+  // upload and present aren't timed, they need a window
+  const uint32_t frames = 20000;
+  const uint32_t palette[1 << DISPLAY_PLANES] = {config->background_color, config->foreground_color,
+                                                  config->plane2_color, config->blend_color};
+  static uint32_t pixels[DISPLAY_HEIGHT][DISPLAY_WIDTH];
+  display_t display = {.hires = true};
+  for (uint32_t plane = 0; plane < DISPLAY_PLANES; plane++)
+    for (uint32_t y = 0; y < DISPLAY_HEIGHT; y++)
+      for (uint32_t w = 0; w < DISPLAY_WORDS; w++)
+        display.rows[plane][y][w] = 0x9E3779B97F4A7C15ull * (plane * DISPLAY_HEIGHT * DISPLAY_WORDS + y * DISPLAY_WORDS + w + 1);
+  
+  const uint64_t start = SDL_GetPerformanceCounter();
+  for (uint32_t f = 0; f < frames; f++) {
+    display.rows[0][0][0] ^= f;
+    for (uint32_t y = 0; y < DISPLAY_HEIGHT; y++)
+      expand_row(&display, y, pixels[y], DISPLAY_WIDTH, palette);
   }
-  SDL_RenderPresent(sdl.renderer);
+  const double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+  
+  // folded into the output so the expansion can't be optimized away
+  uint32_t checksum = 0;
+  for (uint32_t y = 0; y < DISPLAY_HEIGHT; y++)
+    checksum += pixels[y][y];
+  
+  printf("\n  ],\n  \"expand\": {\"frames\": %u, \"ns_per_frame\": %.1f, \"checksum\": %u}\n}\n",
+         frames, seconds * 1e9 / frames, checksum);
+  return ok;
 }
 
-void update_timers(const sdl_t sdl, chip8_t *chip8) {
-  if (chip8->delay_timer)
-    chip8->delay_timer--;
+// Everything a windowed session shares between the window thread and the emulation thread
+typedef struct {
+  chip8_t *chip8;             // only touched by the emulation thread while it runs
+  const config_t *config;
+  library_t *library;
+  sdl_t *sdl;                 // the emulation thread only uses the audio gate and input atomics
+  FILE *record;               // input log, NULL if not recording
+  uint64_t recorded_frames;
+  rewind_t *history;          // NULL if rewinding is off
+  controls_t controls;
+  framebuffer_t framebuffer;
+  atomic_uint_least64_t ips;  // effective instructions per second, measured over roughly one second
+  uint32_t wake_event;        // pushed to wake the window thread for a new frame or IPS value
+} session_t;
+
+// lets the window thread know there is something new, SDL_PushEvent is safe from any thread
+static void session_wake(const session_t *session) {
+  SDL_Event event = {.type = session->wake_event};
+  SDL_PushEvent(&event);
+}
+
+// hands the changed display to the window thread. A press carried by a frame that was replaced before the
+// window thread took it moves on to the next one
+static void session_publish(session_t *session, uint64_t *unshown_press) {
+  chip8_t *chip8 = session->chip8;
+  framebuffer_t *framebuffer = &session->framebuffer;
+  frame_t *frame = &framebuffer->frames[framebuffer->back];
   
-  if (chip8->sound_timer) {
-    chip8->sound_timer--;
-    SDL_PauseAudioDevice(sdl.device, 0);  // play a sound
-  } else {
-    SDL_PauseAudioDevice(sdl.device, 1);  // stop playing a sound
+  frame->display = chip8->display;
+  frame->press = *unshown_press;
+  *unshown_press = 0;
+  if (framebuffer_publish(framebuffer))
+    *unshown_press = framebuffer->frames[framebuffer->back].press;
+  if (chip8->export) export_publish(chip8->export, &chip8->display);
+  chip8->dirty_rows = 0;
+  session_wake(session);
+}
+
+// Emulation thread of a windowed session. It paces emulated frames against real time and runs their
+// bursts, timers, audio gate, history and input log, and publishes each changed display. Presenting
+// happens on the window thread, so a slow present or vsync wait never delays emulation
+static int emulation_thread(void *data) {
+  session_t *session = (session_t *) data;
+  chip8_t *chip8 = session->chip8;
+  const config_t *config = session->config;
+  library_t *library = session->library;
+  controls_t *controls = &session->controls;
+  
+  scheduler_t scheduler;
+  scheduler_reset(&scheduler);
+  cycle_budget_t budget = cycle_budget(config->clock_speed);
+  
+  uint64_t ips_cycles = 0;
+  uint64_t ips_start = scheduler.origin;
+  
+  // oldest key press the machine has seen whose response hasn't been published yet, for the profiler
+  uint64_t unshown_press = 0;
+  bool paused = false;
+  while (!atomic_load(&controls->quit)) {
+    // PAGEUP/PAGEDOWN step through the library in place, the window and audio device stay open. Not while
+    // recording, since the input log only describes one ROM
+    const int rom_switch = atomic_exchange(&controls->rom_switch, 0);
+    if (rom_switch && config->library_path && !session->record) {
+      // the index only moves once the ROM is in, a failed load keeps the old one running under its own name
+      const uint32_t index = (library->current + library->count + rom_switch) % library->count;
+      const library_entry_t *next = &library->entries[index];
+      if (chip8_reload(chip8, next->name, library->file.data + next->offset, next->size)) {
+        library->current = index;
+        chip8->quirk_profile = library_quirks(next, config);
+        chip8_seed(chip8, config->seed);
+        budget = cycle_budget(config->clock_speed);
+        scheduler_reset(&scheduler);
+        if (session->history) rewind_clear(session->history);
+        SDL_Log("=== LOADED %s ===\n", next->name);
+      }
+    }
+    
+    const uint32_t requests = atomic_exchange(&controls->requests, 0);
+    if ((requests & REQUEST_SAVE_STATE) && save_state_file(chip8))
+      SDL_Log("=== STATE SAVED ===\n");
+    // loading a state mid recording would leave an input log that can't replay it
+    if ((requests & REQUEST_LOAD_STATE) && session->record)
+      SDL_Log("Not loading a state while recording input\n");
+    else if ((requests & REQUEST_LOAD_STATE) && load_state_file(chip8))
+      SDL_Log("=== STATE LOADED ===\n");
+    if ((requests & REQUEST_PROFILE_DUMP) && chip8->profile)
+      profile_dump(chip8->profile);
+    
+    // resuming must not try to catch up on the paused time
+    if (atomic_load(&controls->paused)) {
+      paused = true;
+      SDL_Delay(10);
+      continue;
+    }
+    if (paused) {
+      paused = false;
+      scheduler_reset(&scheduler);
+      ips_cycles = 0;
+      ips_start = scheduler.origin;
+    }
+    chip8->turbo = atomic_load(&controls->turbo);
+    chip8->rewinding = atomic_load(&controls->rewinding);
+    
+    const uint64_t frame_start = SDL_GetPerformanceCounter();
+    uint64_t slice_wait = 0;
+    
+    // emulate every frame whose deadline has passed, each one a burst of instructions and a timer tick.
+    // fast forward runs turbo_factor emulated frames per real one, timers still tick once per emulated frame
+    const uint32_t frames_per_deadline = chip8->turbo ? config->turbo_factor : 1;
+    for (uint32_t due = scheduler_due_frames(&scheduler); due; due--) {
+      for (uint32_t frame = 0; frame < frames_per_deadline; frame++) {
+        // rewinding replaces emulation, stopping at the oldest frame still in the history
+        if (chip8->rewinding) {
+          if (session->history) rewind_step(session->history, chip8);
+          continue;
+        }
+        
+        input_sample(&session->sdl->input, chip8, &unshown_press);
+        if (session->record) {
+          input_log_write(session->record, chip8->keypad);
+          session->recorded_frames++;
+        }
+        
+        // a frame that runs on time is spread over its period in slices with the keypad sampled before
+        // each, so key tests see a press within a slice rather than up to a frame late, and a slice that
+        // draws is published right away. Catching up and fast forward run whole frames, as does recording
+        // since the input log holds one keypad per frame
+        const uint32_t burst = cycle_budget_next(&budget);
+        const uint32_t slices = due == 1 && frames_per_deadline == 1 && !session->record ? INPUT_SLICES : 1;
+        for (uint32_t slice = 0; slice < slices; slice++) {
+          if (slice) {
+            const uint64_t wait_start = SDL_GetPerformanceCounter();
+            scheduler_wait_slice(&scheduler, slice, slices);
+            slice_wait += SDL_GetPerformanceCounter() - wait_start;
+            input_sample(&session->sdl->input, chip8, &unshown_press);
+          }
+          run_burst(chip8, config, burst * (slice + 1) / slices - burst * slice / slices);
+          if (slices > 1 && chip8->dirty_rows) session_publish(session, &unshown_press);
+        }
+        ips_cycles += burst;
+        update_timers(chip8);
+        if (session->history) rewind_push(session->history, chip8);
+      }
+      update_audio(session->sdl, chip8);
+      scheduler.frame++;
+    }
+    
+    // only the latest display gets handed over when catching up or fast forwarding
+    if (chip8->dirty_rows) session_publish(session, &unshown_press);
+    
+    const uint64_t emulated = SDL_GetPerformanceCounter();
+    scheduler_wait(&scheduler, config->precise);
+    const uint64_t now = SDL_GetPerformanceCounter();
+    
+    if (chip8->profile) {
+      profile_phase(chip8->profile, PHASE_EMULATE, (emulated - frame_start - slice_wait) * 1000000000 / scheduler.frequency);
+      profile_phase(chip8->profile, PHASE_SLEEP, (now - emulated + slice_wait) * 1000000000 / scheduler.frequency);
+      profile_frame(chip8->profile, (now - frame_start) * 1000000000 / scheduler.frequency);
+    }
+    
+    if (now - ips_start >= scheduler.frequency) {
+      atomic_store(&session->ips, (uint64_t) ((double) ips_cycles * scheduler.frequency / (now - ips_start)));
+      ips_cycles = 0;
+      ips_start = now;
+      session_wake(session);
+    }
   }
+  return 0;
 }
 
 int main(int argc, char **argv) {
   // print usage if invalid args
   if (argc < 2) {
-    fprintf(stderr, "Usage: %s <rom_file>\n", argv[0]);
+    print_usage(argv[0]);
     exit(EXIT_FAILURE);
   }
   
@@ -708,52 +5194,302 @@ int main(int argc, char **argv) {
   if (!set_config_from_args(&config, argc, argv))
     exit(EXIT_FAILURE);
   
-  // sdl initialization
-  sdl_t sdl = {0};
-  if (!sdl_init(&sdl, &config))
+  // headless runs never touch SDL video or audio
+  if (config.headless) {
+    signal(SIGINT, headless_signal_handler);
+    signal(SIGTERM, headless_signal_handler);
+  }
+  
+  // a replay runs with the seed and clock it was recorded with
+  input_log_t replay = {0};
+  if (config.replay_path) {
+    if (!input_log_load(config.replay_path, &replay))
+      exit(EXIT_FAILURE);
+    config.seed = replay.header.seed;
+    config.seed_given = true;
+    config.clock_speed = replay.header.clock_speed;
+  }
+  
+  // an unseeded run still gets a seed that is printed, so any run can be reproduced
+  if (!config.seed_given)
+    config.seed = (uint32_t) SDL_GetPerformanceCounter() | 1;
+  
+  if (config.bench)
+    exit(run_bench(&config) ? EXIT_SUCCESS : EXIT_FAILURE);
+  
+  if (config.decode_trace_path)
+    exit(decode_trace(config.decode_trace_path) ? EXIT_SUCCESS : EXIT_FAILURE);
+  
+  if (config.pack_path)
+    exit(library_pack(config.pack_path, config.roms, config.rom_count,
+                   config.quirk_profile < 0 ? QUIRKS_DEFAULT : config.quirk_profile) ? EXIT_SUCCESS : EXIT_FAILURE);
+  
+  // with a library the ROM argument names an entry, and without one the first entry runs
+  library_t library = {0};
+  if (config.library_path) {
+    if (!library_open(&library, config.library_path))
+      exit(EXIT_FAILURE);
+    library.current = config.rom_count ? library_find(&library, config.roms[0]) : 0;
+    if (library.current == library.count) {
+      SDL_Log("No ROM named %s in %s\n", config.roms[0], config.library_path);
+      exit(EXIT_FAILURE);
+    }
+  } else if (!config.rom_count) {
+    fprintf(stderr, "No ROM file given\n");
     exit(EXIT_FAILURE);
+  }
+  
+  // a server runs one machine per client instead of any here
+  if (config.serve_port)
+    exit(run_server(&config, config.library_path ? &library : NULL) ? EXIT_SUCCESS : EXIT_FAILURE);
+  
+  // lockstep batches run many instances of one ROM side by side
+  if (config.batch)
+    exit(run_batches(&config) ? EXIT_SUCCESS : EXIT_FAILURE);
+  
+  // several ROMs or instances get spread over a thread pool
+  if (config.headless && !config.library_path && (config.rom_count > 1 || config.repeat > 1 || config.jobs != 1))
+    exit(run_parallel(&config) ? EXIT_SUCCESS : EXIT_FAILURE);
   
   // chip8 machine initialization
   chip8_t chip8 = {0};
-  const char *rom_name = argv[1];
-  if (!chip8_init(&chip8, rom_name))
+  const library_entry_t *entry = config.library_path ? &library.entries[library.current] : NULL;
+  const bool loaded = entry ? chip8_load(&chip8, entry->name, library.file.data + entry->offset, entry->size)
+                            : chip8_init(&chip8, config.roms[0]);
+  if (!loaded || !engine_init(&chip8, &config) || !profile_init(&chip8, &config) || !trace_init(&chip8, &config) ||
+      !export_init(&chip8, &config))
+    exit(EXIT_FAILURE);
+  if (entry) chip8.quirk_profile = library_quirks(entry, &config);
+  chip8_seed(&chip8, config.seed);
+  if (config.replay_path && !input_log_matches(&replay, &chip8, config.replay_path))
+    exit(EXIT_FAILURE);
+  if (config.precompile && !precompile_rom(&chip8, &config))
+    exit(EXIT_FAILURE);
+  
+  if (config.headless) {
+    run_headless(&chip8, &config, config.replay_path ? &replay : NULL);
+    free(replay.frames);
+    if (chip8.profile) profile_dump(chip8.profile);
+    profile_finish(&chip8, &config);
+    trace_finish(&chip8);
+    export_finish(&chip8, &config);
+    chip8_finish(&chip8);
+    library_close(&library);
+    exit(EXIT_SUCCESS);
+  }
+  
+  // sdl initialization
+  sdl_t sdl = {0};
+  if (!sdl_init(&sdl, &config))
     exit(EXIT_FAILURE);
   
   // initial screen clear
-  if (!clear_screen(sdl, config))
+  if (!clear_screen(&sdl))
     exit(EXIT_FAILURE);
   
-  // main emulation loop
-  while (chip8.state != STOPPED) {
-    // handle user input
-    handle_input(&chip8);
-    
-    // needs to be after handling input otherwise we could never change the program state
-    if (chip8.state == PAUSED) continue;
-    
-    // start timer
-    uint64_t frame_start = SDL_GetPerformanceCounter();
+  // every emulated frame's keypad goes to the input log, so a recorded session can be replayed headless
+  FILE *record = NULL;
+  if (config.record_path && !(record = input_log_create(config.record_path, &chip8, &config)))
+    exit(EXIT_FAILURE);
+  
+  // rewinding would make the recorded frames diverge from the replay, so it is off while recording
+  rewind_t history = {0};
+  const bool rewind_enabled = config.rewind_seconds != 0 && !record;
+  if (rewind_enabled && !rewind_init(&history, config.rewind_seconds * FRAME_RATE))
+    exit(EXIT_FAILURE);
+  
+  // the machine belongs to the emulation thread from here on, this thread only handles events and presents
+  session_t session = {
+    .chip8 = &chip8,
+    .config = &config,
+    .library = &library,
+    .sdl = &sdl,
+    .record = record,
+    .history = rewind_enabled ? &history : NULL,
+    .wake_event = SDL_RegisterEvents(1),
+  };
+  framebuffer_init(&session.framebuffer);
+  SDL_Thread *emulator = SDL_CreateThread(emulation_thread, "chip8 emulation", &session);
+  if (!emulator) {
+    SDL_Log("Unable to start the emulation thread: %s\n", SDL_GetError());
+    exit(EXIT_FAILURE);
+  }
+  
+  const uint64_t frequency = SDL_GetPerformanceFrequency();
+  display_t display = {0};                // what the window shows
+  uint64_t dirty_rows = UINT64_MAX;       // first frame always gets drawn
+  uint64_t unshown_press = 0;             // oldest press whose response is in the display but not presented yet
+  uint64_t title_ips = 0;
+  while (!atomic_load(&session.controls.quit)) {
+    // nothing to do until there is input or the emulation thread has a new frame or IPS value
+    SDL_WaitEvent(NULL);
+    handle_input(&session.controls, &dirty_rows);
     
-    // emulate chip8 instructions according to clock speed but also allowing screen updates at ~60hz
-    for (uint8_t i = 0; i < config.clock_speed / 60; i++)
-      emulate_instruction(&chip8, config);
+    // frames the emulator produced in between are skipped, only rows that differ from the window get drawn
+    const frame_t *frame = framebuffer_take(&session.framebuffer);
+    if (frame) {
+      dirty_rows |= display_diff(&display, &frame->display);
+      display = frame->display;
+      if (frame->press && !unshown_press) unshown_press = frame->press;
+    }
     
-    // end timer and calculate duration
-    uint64_t frame_end = SDL_GetPerformanceCounter();
-    double frame_duration = (double) ((frame_end - frame_start) * 1000) / SDL_GetPerformanceFrequency();
-
-    // should approximate 60hz (1 frame per ~16.667ms)
-    SDL_Delay(frame_duration >= 16.667f ? 0 : 16.667f - frame_duration);
+    const uint64_t render_start = SDL_GetPerformanceCounter();
+    const bool presented = update_screen(&sdl, &config, &display, dirty_rows);
+    dirty_rows = 0;
+    const uint64_t rendered = SDL_GetPerformanceCounter();
+    if (presented)
+      SDL_RenderPresent(sdl.renderer);  // with vsync this blocks until the next refresh, the emulator keeps going
+    const uint64_t shown = SDL_GetPerformanceCounter();
     
-    // update screen every ~60hz
-    update_screen(sdl, config, chip8);
+    if (presented && chip8.profile) {
+      profile_phase(chip8.profile, PHASE_RENDER, (rendered - render_start) * 1000000000 / frequency);
+      profile_phase(chip8.profile, PHASE_PRESENT, (shown - rendered) * 1000000000 / frequency);
+    }
+    if (presented && unshown_press) {
+      if (chip8.profile) profile_press(chip8.profile, (shown - unshown_press) * 1000000000 / frequency);
+      unshown_press = 0;
+    }
     
-    // update timers every ~60hz
-    update_timers(sdl, &chip8);
+    const uint64_t ips = atomic_load(&session.ips);
+    if (ips != title_ips) {
+      char title[64];
+      snprintf(title, sizeof title, "Chip8 Emulator by Smeechy - %llu IPS", (unsigned long long) ips);
+      SDL_SetWindowTitle(sdl.window, title);
+      title_ips = ips;
+    }
+  }
+  SDL_WaitThread(emulator, NULL);
+  
+  // the final state lets a replay of the log be checked against this session
+  if (record) {
+    SDL_Log("Recorded %llu frames, state_hash=0x%016llX\n", (unsigned long long) session.recorded_frames,
+            (unsigned long long) state_hash(&chip8));
+    if (fclose(record) != 0)
+      SDL_Log("Failed to write input log: %s\n", config.record_path);
   }
   
-  // sdl cleanup
-  sdl_finish(sdl);
+  if (chip8.profile) profile_dump(chip8.profile);
+  
+  // cleanup
+  trace_finish(&chip8);
+  profile_finish(&chip8, &config);
+  export_finish(&chip8, &config);
+  if (rewind_enabled) rewind_finish(&history);
+  chip8_finish(&chip8);
+  library_close(&library);
+  sdl_finish(&sdl);
   
   exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
+#endif
+
+#ifdef CHIP8_LIBRARY
+// the public constants and enums are the same values the core uses, so they pass through unconverted
+_Static_assert(CHIP8_DISPLAY_WIDTH == DISPLAY_WIDTH && CHIP8_DISPLAY_HEIGHT == DISPLAY_HEIGHT &&
+               CHIP8_DISPLAY_WORDS == DISPLAY_WORDS && CHIP8_DISPLAY_PLANES == DISPLAY_PLANES &&
+               CHIP8_RAM_SIZE == RAM_SIZE, "chip8.h display and ram sizes differ from the core");
+_Static_assert((int) CHIP8_ENGINE_JIT == ENGINE_JIT && (int) CHIP8_QUIRKS_XOCHIP == QUIRKS_XOCHIP &&
+               QUIRK_PROFILE_COUNT == QUIRKS_XOCHIP + 1, "chip8.h enums differ from the core");
+
+// One embedded machine. The config only carries what the core reads: engine, quirks, clock and seed
+struct chip8_core {
+  chip8_t chip8;
+  config_t config;
+  cycle_budget_t budget;
+  uint32_t frame_left;      // cycles until the current frame's timer tick
+};
+
+chip8_core_t *chip8_create(const chip8_options_t *options) {
+  chip8_core_t *core = calloc(1, sizeof(chip8_core_t));
+  if (!core) return NULL;
+  
+  const chip8_options_t defaults = {0};
+  if (!options) options = &defaults;
+  core->config = (config_t) {
+    .clock_speed = options->clock_speed ? options->clock_speed : 700,
+    .engine = options->engine <= CHIP8_ENGINE_JIT ? (engine_t) options->engine : ENGINE_SWITCH,
+    .quirk_profile = options->quirks <= CHIP8_QUIRKS_XOCHIP ? (int) options->quirks : QUIRKS_DEFAULT,
+    .seed = options->seed,
+  };
+  return core;
+}
+
+void chip8_destroy(chip8_core_t *core) {
+  if (!core) return;
+  chip8_finish(&core->chip8);
+  free(core);
+}
+
+bool chip8_load_rom_from_memory(chip8_core_t *core, const uint8_t *rom, size_t size) {
+  chip8_t *chip8 = &core->chip8;
+  
+  // the engine caches are allocated with the first ROM and kept for the ones after it
+  if (chip8->ram) {
+    if (!chip8_reload(chip8, "rom", rom, size)) return false;
+  } else if (!chip8_load(chip8, "rom", rom, size) || !engine_init(chip8, &core->config)) {
+    chip8_finish(chip8);
+    return false;
+  }
+  
+  chip8_seed(chip8, core->config.seed);
+  core->budget = cycle_budget(core->config.clock_speed);
+  core->frame_left = cycle_budget_next(&core->budget);
+  return true;
+}
+
+uint32_t chip8_run_cycles(chip8_core_t *core, uint64_t cycles) {
+  chip8_t *chip8 = &core->chip8;
+  if (!chip8->ram) return 0;
+  
+  // the same frame structure as a headless run, a burst of the frame's cycles and then a timer tick
+  uint32_t frames = 0;
+  for (;;) {
+    const uint32_t burst = cycles < core->frame_left ? (uint32_t) cycles : core->frame_left;
+    run_burst(chip8, &core->config, burst);
+    cycles -= burst;
+    core->frame_left -= burst;
+    if (core->frame_left) break;
+    
+    update_timers(chip8);
+    frames++;
+    core->frame_left = cycle_budget_next(&core->budget);
+    if (!cycles) break;
+  }
+  return frames;
+}
+
+void chip8_run_until_frame(chip8_core_t *core) {
+  chip8_run_cycles(core, core->frame_left);
+}
+
+void chip8_set_keypad(chip8_core_t *core, uint16_t keys) {
+  core->chip8.keypad = keys;
+}
+
+chip8_framebuffer_t chip8_framebuffer(chip8_core_t *core) {
+  const display_t *display = &core->chip8.display;
+  const chip8_framebuffer_t framebuffer = {
+    .rows = &display->rows[0][0][0],
+    .width = display_width(display),
+    .height = display_height(display),
+    .dirty_rows = core->chip8.dirty_rows,
+  };
+  core->chip8.dirty_rows = 0;
+  return framebuffer;
+}
+
+uint8_t chip8_sound_timer(const chip8_core_t *core) {
+  return core->chip8.sound_timer;
+}
+
+uint8_t *chip8_ram(chip8_core_t *core) {
+  return core->chip8.ram;
+}
+
+void chip8_ram_written(chip8_core_t *core, uint32_t address, uint32_t length) {
+  if (!core->chip8.ram || address >= RAM_SIZE) return;
+  // the host writes a flat buffer, so a length past its end is clamped rather than wrapped
+  if (length > RAM_SIZE - address) length = RAM_SIZE - address;
+  invalidate_code(&core->chip8, address, length);
+}
+#endif
@@ -0,0 +1,84 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+// Embeddable chip8 core, built into libchip8.a and libchip8.so by make lib. It has no SDL dependency:
+// the host draws the display, plays a tone while the sound timer runs and feeds the keypad. Every
+// chip8_core_t is a whole machine of its own, so any number can run side by side, one thread each
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define CHIP8_API __attribute__((visibility("default")))
+#else
+#define CHIP8_API
+#endif
+
+#define CHIP8_DISPLAY_WIDTH 128  // SUPER-CHIP hires, lores only uses the top left 64x32
+#define CHIP8_DISPLAY_HEIGHT 64
+#define CHIP8_DISPLAY_WORDS 2    // 64 bit words per row, bit 63 of the first is the leftmost pixel
+#define CHIP8_DISPLAY_PLANES 2   // XO-CHIP bitplanes, a pixel's bit in each picks one of 4 colors
+#define CHIP8_RAM_SIZE 0x10000
+
+typedef struct chip8_core chip8_core_t;
+
+// Instruction execution engines, the same as --engine
+typedef enum {
+  CHIP8_ENGINE_SWITCH,
+  CHIP8_ENGINE_CACHED,
+  CHIP8_ENGINE_BLOCK,
+  CHIP8_ENGINE_JIT     // falls back to the block engine where native code isn't supported
+} chip8_engine_t;
+
+// Quirk profiles, the same as --quirks
+typedef enum {
+  CHIP8_QUIRKS_DEFAULT,
+  CHIP8_QUIRKS_VIP,
+  CHIP8_QUIRKS_CHIP48,
+  CHIP8_QUIRKS_SCHIP,
+  CHIP8_QUIRKS_XOCHIP
+} chip8_quirks_t;
+
+// Machine settings, chip8_create takes NULL for all defaults
+typedef struct {
+  uint32_t clock_speed;    // instructions per second, 0 for the default 700
+  chip8_engine_t engine;
+  chip8_quirks_t quirks;
+  uint32_t seed;           // CXNN random seed, the same seed and keypad input always replay the same run
+} chip8_options_t;
+
+// The machine's display in place, no copy is made
+typedef struct {
+  const uint64_t *rows;    // [plane][row][word], CHIP8_DISPLAY_HEIGHT * CHIP8_DISPLAY_WORDS words per plane
+  uint32_t width;          // of the active mode, 64x32 or 128x64
+  uint32_t height;
+  uint64_t dirty_rows;     // bitmask of rows changed since the last chip8_framebuffer call
+} chip8_framebuffer_t;
+
+// returns NULL when out of memory. The machine has no ROM and runs nothing until one is loaded
+CHIP8_API chip8_core_t *chip8_create(const chip8_options_t *options);
+CHIP8_API void chip8_destroy(chip8_core_t *core);
+
+// resets the machine and copies in a ROM, the image can be freed once this returns
+CHIP8_API bool chip8_load_rom_from_memory(chip8_core_t *core, const uint8_t *rom, size_t size);
+
+// runs cycles instructions, ticking the 60hz timers whenever a frame's worth of the clock speed has run.
+// Frames carry over between calls, so cycles don't have to line up with them. Returns the frames ticked
+CHIP8_API uint32_t chip8_run_cycles(chip8_core_t *core, uint64_t cycles);
+
+// runs the rest of the current frame and its timer tick
+CHIP8_API void chip8_run_until_frame(chip8_core_t *core);
+
+// bit n set while key n is down, held until changed
+CHIP8_API void chip8_set_keypad(chip8_core_t *core, uint16_t keys);
+
+CHIP8_API chip8_framebuffer_t chip8_framebuffer(chip8_core_t *core);
+CHIP8_API uint8_t chip8_sound_timer(const chip8_core_t *core);
+
+// CHIP8_RAM_SIZE bytes, valid until the next ROM load. After writing to it call chip8_ram_written,
+// so the engines drop code they translated from the old bytes
+CHIP8_API uint8_t *chip8_ram(chip8_core_t *core);
+CHIP8_API void chip8_ram_written(chip8_core_t *core, uint32_t address, uint32_t length);
+
+#endif
@@ -0,0 +1,45 @@
+// Minimal chip8.h host, built by make example against the static libchip8.a. Runs a ROM for a number of
+// frames with no keys down and prints the display as text, hires ROMs show their full 128x64
+#include <stdio.h>
+#include <stdlib.h>
+#include "chip8.h"
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <rom_file> [frames]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const long frames = argc > 2 ? strtol(argv[2], NULL, 10) : 60;
+  
+  FILE *file = fopen(argv[1], "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Unable to open ROM file: %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  static uint8_t rom[CHIP8_RAM_SIZE];
+  const size_t size = fread(rom, 1, sizeof rom, file);
+  fclose(file);
+  
+  const chip8_options_t options = {.engine = CHIP8_ENGINE_BLOCK, .seed = 1};
+  chip8_core_t *core = chip8_create(&options);
+  if (core == NULL || !chip8_load_rom_from_memory(core, rom, size)) {
+    fprintf(stderr, "Unable to load %s\n", argv[1]);
+    chip8_destroy(core);
+    return EXIT_FAILURE;
+  }
+  
+  for (long f = 0; f < frames; f++)
+    chip8_run_until_frame(core);
+  
+  // the first plane is enough for a text dump, bit 63 of a row's first word is its leftmost pixel
+  const chip8_framebuffer_t framebuffer = chip8_framebuffer(core);
+  for (uint32_t y = 0; y < framebuffer.height; y++) {
+    const uint64_t *row = &framebuffer.rows[y * CHIP8_DISPLAY_WORDS];
+    for (uint32_t x = 0; x < framebuffer.width; x++)
+      putchar(row[x / 64] >> (63 - x % 64) & 1 ? '#' : '.');
+    putchar('\n');
+  }
+  
+  chip8_destroy(core);
+  return EXIT_SUCCESS;
+}